@@ -0,0 +1,82 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <random>
+#include <cmath>
+#include <numeric>
+
+// Walker's alias method, built with Vose's algorithm: O(n) memory and construction, O(1) draws.
+// Each column holds a value i and an alias. A draw picks a column uniformly, then
+// returns i with probability `probability` and the alias otherwise.
+struct AliasTable {
+    struct Column {
+        float probability;
+        int alias;
+    };
+    std::vector<Column> table;
+
+    AliasTable() = default;
+
+    // Draws i with a probability proportional to weights[i]^power
+    template<typename T>
+    AliasTable(const std::vector<T>& weights, double power) {
+        using namespace std;
+        int n = weights.size();
+        if (n == 0) return;
+        table.resize(n);
+        vector<double> p(n);
+        double sum = 0;
+        for (int i = 0; i < n; i++) {
+            p[i] = pow(weights[i], power);
+            sum += p[i];
+        }
+        vector<int> small, large;
+        for (int i = 0; i < n; i++) {
+            p[i] *= n / sum;
+            (p[i] < 1 ? small : large).emplace_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            int s = small.back(); small.pop_back();
+            int l = large.back();
+            table[s] = {(float)p[s], l};
+            p[l] -= 1 - p[s];
+            if (p[l] < 1) {
+                large.pop_back();
+                small.emplace_back(l);
+            }
+        }
+        // What is left has a probability of 1 up to rounding errors
+        for (int i : large) table[i] = {1, i};
+        for (int i : small) table[i] = {1, i};
+    }
+
+    int size() const {
+        return table.size();
+    }
+
+    template<typename Generator>
+    int operator()(Generator& generator) const {
+        std::uniform_int_distribution<int> column(0, size() - 1);
+        std::uniform_real_distribution<float> coin(0, 1);
+        const Column& c = table[column(generator)];
+        return coin(generator) < c.probability ? &c - table.data() : c.alias;
+    }
+
+    // Same from 64 random bits: the high half picks the column, the low 24 bits are the coin
+    int draw(uint64_t bits) const {
+        const Column& c = table[((bits >> 32) * (uint64_t)size()) >> 32];
+        return (bits & 0xffffff) * 0x1p-24f < c.probability ? &c - table.data() : c.alias;
+    }
+
+    // Exact probability of drawing each value, to check the table against the weights
+    std::vector<double> distribution() const {
+        std::vector<double> res(size());
+        for (int i = 0; i < size(); i++) {
+            res[i] += table[i].probability;
+            res[table[i].alias] += 1 - table[i].probability;
+        }
+        for (double& x : res) x /= size();
+        return res;
+    }
+};
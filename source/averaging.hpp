@@ -0,0 +1,148 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <future>
+#include <chrono>
+#include <execution>
+#include <algorithm>
+#include "util.hpp"
+#include "net.hpp"
+
+// Periodic averaging of the model between the processes of a distributed training, in a star
+// around rank 0. A round starts from a snapshot of the parameters; the exchange runs in the
+// background while the training goes on; then each process adds (average - snapshot) to its
+// parameters, which keeps what it learned during the exchange.
+struct ModelAverager {
+    int rank = 0;
+    int world = 1;
+    // Rank 0: one socket per other rank. Others: the socket to rank 0.
+    std::vector<Socket> peers;
+    std::vector<Matrix<float>*> matrices;
+    std::vector<float> sent;
+    std::vector<float> average;
+    std::vector<float> received;
+    // Words processed by this process when the snapshot was taken, and by all of them
+    long long words = 0;
+    long long total_words = 0;
+    std::future<bool> exchange;
+    int rounds = 0;
+    // Time spent by the exchanges, in the background
+    double seconds = 0;
+
+    // Connects the processes, rank 0 listening on `address`. All ranks must have matrices of the same sizes.
+    bool connect(const std::string& address, int rank, int world, std::vector<Matrix<float>*> matrices) {
+        this->rank = rank;
+        this->world = world;
+        this->matrices = matrices;
+        long long size = 0;
+        for (Matrix<float>* m : matrices) size += (long long)m->rows * m->cols;
+        sent.resize(size);
+        average.resize(size);
+        if (world == 1) return true;
+        if (rank > 0) {
+            peers.emplace_back(Socket::connect(address, 60));
+            long long hello[2] = {rank, size};
+            char ok = 0;
+            return peers[0].ok() && peers[0].send(hello, sizeof(hello)) && peers[0].receive(&ok, 1) && ok;
+        }
+        Listener listener{address};
+        if (!listener.ok()) return false;
+        received.resize(size);
+        peers.resize(world - 1);
+        for (int i = 1; i < world; i++) {
+            Socket s = listener.accept();
+            long long hello[2];
+            if (!s.ok() || !s.receive(hello, sizeof(hello))) return false;
+            char ok = hello[0] > 0 && hello[0] < world && hello[1] == size && !peers[hello[0] - 1].ok();
+            if (!s.send(&ok, 1) || !ok) return false;
+            peers[hello[0] - 1] = std::move(s);
+        }
+        return true;
+    }
+
+    bool pending() const {
+        return exchange.valid();
+    }
+
+    bool done() const {
+        return exchange.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    // Takes the snapshot and starts the exchange. No update may run during the call.
+    void start(long long words) {
+        using namespace std;
+        this->words = words;
+        float* p = sent.data();
+        for (Matrix<float>* m : matrices) {
+            for (int i = 0; i < m->rows; i++, p += m->cols) copy_n(m->row(i), m->cols, p);
+        }
+        exchange = async(launch::async, [this] {
+            auto start = chrono::steady_clock::now();
+            bool ok = true;
+            if (world == 1) {
+                average = sent;
+                total_words = this->words;
+            } else {
+                ok = rank == 0 ? gather() : send();
+            }
+            seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            return ok;
+        });
+    }
+
+    // Waits for the exchange and adds (average - snapshot) to the parameters. No update may run
+    // during the call. Returns false if the exchange failed, the parameters being left unchanged.
+    // With `last`, there was no update since the snapshot, and the parameters become the average
+    // itself, the same bits on all the processes.
+    bool finish(bool last = false) {
+        using namespace std;
+        if (!exchange.get()) return false;
+        rounds++;
+        // Rows of all the matrices, with their place in the snapshot
+        struct Row {
+            float* values;
+            long long offset;
+            int cols;
+        };
+        vector<Row> rows;
+        long long offset = 0;
+        for (Matrix<float>* m : matrices) {
+            for (int i = 0; i < m->rows; i++, offset += m->cols) rows.push_back({m->row(i), offset, m->cols});
+        }
+        for_each(execution::par_unseq, rows.begin(), rows.end(), [&](const Row& r) {
+            if (last) {
+                copy_n(average.data() + r.offset, r.cols, r.values);
+                return;
+            }
+            for (int j = 0; j < r.cols; j++) r.values[j] += average[r.offset + j] - sent[r.offset + j];
+        });
+        return true;
+    }
+
+    // Rank 0: sums the snapshots of all the ranks and sends back their average
+    bool gather() {
+        using namespace std;
+        average = sent;
+        total_words = words;
+        for (const Socket& s : peers) {
+            long long w;
+            if (!s.receive(&w, sizeof(w)) || !s.receive(received.data(), received.size() * sizeof(float))) return false;
+            total_words += w;
+            for (size_t i = 0; i < average.size(); i++) average[i] += received[i];
+        }
+        for (float& x : average) x /= world;
+        for (const Socket& s : peers) {
+            if (!s.send(&total_words, sizeof(total_words)) || !s.send(average.data(), average.size() * sizeof(float))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool send() {
+        const Socket& s = peers[0];
+        return s.send(&words, sizeof(words)) && s.send(sent.data(), sent.size() * sizeof(float)) &&
+               s.receive(&total_words, sizeof(total_words)) && s.receive(average.data(), average.size() * sizeof(float));
+    }
+};
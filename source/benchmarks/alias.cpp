@@ -0,0 +1,89 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+#include <unistd.h>
+#include "../alias.hpp"
+#include "../rng.hpp"
+
+// Negative samples drawn per second, build time and resident memory of the alias table,
+// against the unigram table of 2e8 ids it replaced. Arguments: vocabulary size (1000000 by
+// default), number of draws (100000000) and size of the unigram table (200000000).
+
+// Resident memory of the process, in MB
+double resident() {
+    std::ifstream statm{"/proc/self/statm"};
+    long long size = 0, pages = 0;
+    statm >> size >> pages;
+    return pages * sysconf(_SC_PAGESIZE) / 1048576.0;
+}
+
+double since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Built as the unigram table was, with float accumulation
+std::vector<int> unigram_table(const std::vector<long long>& cnt, int precision) {
+    using namespace std;
+    constexpr float power = 0.75;
+    vector<int> res;
+    float words_power = accumulate(begin(cnt), end(cnt), 1, [&](float acc, long long v) { return acc + pow(v, power); });
+    int ix = 0;
+    float p = pow(cnt[ix], power) / words_power;
+    for (int i = 0;; i++) {
+        res.emplace_back(ix);
+        if (i > p * precision) {
+            ix++;
+            if (ix == (int)cnt.size()) break;
+            p += pow(cnt[ix], power) / words_power;
+        }
+    }
+    return res;
+}
+
+int main(int argc, char* argv[]) {
+    using namespace std;
+    long long vocabulary = argc > 1 ? stoll(argv[1]) : 1000000;
+    long long draws = argc > 2 ? stoll(argv[2]) : 100000000;
+    int precision = argc > 3 ? stoi(argv[3]) : 200000000;
+    vector<long long> cnt(vocabulary);
+    for (long long i = 0; i < vocabulary; i++) cnt[i] = 1000000000 / (i + 1) + 1;
+    long long checksum = 0;
+    auto report = [&](const string& name, double build, double memory, double seconds) {
+        cout << name << ": built in " << build << "s, " << memory << "MB, " << draws / seconds / 1e6
+             << "M draws/s" << endl;
+    };
+    {
+        double before = resident();
+        auto start = chrono::steady_clock::now();
+        AliasTable table{cnt, 0.75};
+        double build = since(start);
+        double memory = resident() - before;
+        Sampler sampler{1};
+        start = chrono::steady_clock::now();
+        for (long long i = 0; i < draws; i++) checksum += sampler.negative(table);
+        report("alias table, by blocks", build, memory, since(start));
+        mt19937_64 generator{1};
+        start = chrono::steady_clock::now();
+        for (long long i = 0; i < draws; i++) checksum += table(generator);
+        report("alias table, one draw at a time", build, memory, since(start));
+    }
+    {
+        double before = resident();
+        auto start = chrono::steady_clock::now();
+        vector<int> table = unigram_table(cnt, precision);
+        double build = since(start);
+        double memory = resident() - before;
+        mt19937_64 generator{1};
+        uniform_int_distribution<int> index(0, (int)table.size() - 1);
+        start = chrono::steady_clock::now();
+        for (long long i = 0; i < draws; i++) checksum += table[index(generator)];
+        report("unigram table", build, memory, since(start));
+    }
+    // Keeps the draws from being optimized away
+    cerr << checksum << endl;
+}
@@ -0,0 +1,71 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include "../kernels.hpp"
+#include "../matrix.hpp"
+
+// Nanoseconds per call of each kernel of each version the processor supports, and of the relaxed
+// kernels of --hogwild, for the vector
+// sizes given as arguments (50 100 200 300 by default). The vectors stay in the L1 cache, except
+// for output_update on random rows, which reads the rows of a model of 256MB as the training
+// does for its negative samples.
+
+template<typename F>
+double nanoseconds(long long calls, F f) {
+    auto start = std::chrono::steady_clock::now();
+    for (long long i = 0; i < calls; i++) f(i);
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / calls;
+}
+
+int main(int argc, char* argv[]) {
+    using namespace std;
+    vector<int> sizes;
+    for (int i = 1; i < argc; i++) sizes.emplace_back(stoi(argv[i]));
+    if (sizes.empty()) sizes = {50, 100, 200, 300};
+    constexpr long long calls = 2000000;
+    // Sum of the results, so that the calls are not optimized away
+    double sink = 0;
+    cout << fixed << setprecision(1);
+    for (int n : sizes) {
+        // Rows 0 to 2 for the vector kernels, the 4 words of a group and their 6 negative samples
+        // for the matrix products
+        Matrix<float> rows(3, n), group(4, n), negatives(6, n), gradient(4, n), c(4, 6);
+        for (Matrix<float>* m : {&rows, &group, &negatives}) {
+            for (int r = 0; r < m->rows; r++) {
+                for (int i = 0; i < n; i++) (*m)[r][i] = sin(r * n + i + 1.0f) / n;
+            }
+        }
+        Matrix<float> model((1 << 28) / (Matrix<float>(1, n).stride * sizeof(float)), n);
+        vector<int> random_rows(calls);
+        uint64_t x = 1;
+        for (int& r : random_rows) r = ((x = x * 6364136223846793005ULL + 1442695040888963407ULL) >> 33) % model.rows;
+        cout << "size " << n << endl;
+        vector<Kernels> versions = Kernels::supported();
+        versions.emplace_back(Kernels::relaxed());
+        for (const Kernels& k : versions) {
+            float* a = rows.row(0);
+            float* b = rows.row(1);
+            float* e = rows.row(2);
+            double dot = nanoseconds(calls, [&](long long) { sink += k.dot(a, b, n); });
+            double axpy = nanoseconds(calls, [&](long long) { k.axpy(1e-6f, a, b, n); });
+            double scale = nanoseconds(calls, [&](long long) { k.scale(0.999999f, b, n); });
+            double update = nanoseconds(calls, [&](long long) { k.output_update(1e-6f, -1e-6f, a, e, b, n); });
+            double random_update = nanoseconds(calls, [&](long long i) {
+                k.output_update(1e-6f, -1e-6f, a, e, model.row(random_rows[i]), n);
+            });
+            // A group of 4 words against its 6 negative samples, as in word2vec --batch 4
+            double gemm = nanoseconds(calls / 10, [&](long long) {
+                k.gemm_nt(4, 6, n, group.row(0), group.stride, negatives.row(0), negatives.stride, c.row(0), c.stride);
+                k.gemm_nn(4, 6, n, c.row(0), c.stride, negatives.row(0), negatives.stride, gradient.row(0), gradient.stride);
+                sink += gradient[0][0];
+            });
+            cout << setw(8) << k.name << ": dot " << dot << "ns, axpy " << axpy << "ns, scale " << scale
+                 << "ns, output_update " << update << "ns (" << random_update << "ns on random rows), gemm 4x6 "
+                 << gemm << "ns" << endl;
+        }
+    }
+    cerr << sink << endl;
+}
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Words per second and quality of word2vec from 1 to N threads (the number of CPUs by default),
+# with the locks and with --hogwild, on the text of bench_training. From the build directory:
+#   ../source/benchmarks/threads.sh [N] [OPTIONS...]
+# TRAINER (./word2vec by default) and BENCH (./bench_training) can be set in the environment.
+TRAINER=${TRAINER:-./word2vec}
+BENCH=${BENCH:-./bench_training}
+max=${1:-$(nproc)}
+[ $# -gt 0 ] && shift
+threads=1
+while :; do
+    for mode in "" --hogwild; do
+        echo "--thread $threads $mode $*"
+        "$BENCH" "$TRAINER" --thread $threads $mode "$@" 2>/dev/null
+    done
+    [ $threads -ge "$max" ] && break
+    threads=$((threads * 2))
+    [ $threads -gt "$max" ] && threads=$max
+done
@@ -0,0 +1,136 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "../util.hpp"
+
+// Speed, peak memory and quality of a trainer on a synthetic text whose words have known
+// topics. Usage: bench_training TRAINER [OPTIONS...], for example
+// `bench_training ./word2vec --thread 4 --hs`; --train, --output and --seed are added.
+//
+// The text has 4M words in sentences of 20. Each sentence has a topic of 50 words out of 200
+// topics: half of its words are drawn from the topic, the others from the whole vocabulary
+// by Zipf's law. The quality is the share of the words whose nearest neighbour, by cosine
+// similarity, is of the same topic: 0.005 for random vectors. The text is written once in the
+// temporary directory and reused.
+
+constexpr int nb_topics = 200;
+constexpr int topic_size = 50;
+constexpr int vocabulary_size = nb_topics * topic_size;
+constexpr long long text_size = 4000000;
+
+std::string word(int i) {
+    return "t" + std::to_string(i / topic_size) + "w" + std::to_string(i % topic_size);
+}
+
+void write_text(const std::filesystem::path& filename) {
+    std::ofstream os{filename};
+    uint64_t x = 1;
+    auto next = [&] {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (x >> 11) * 0x1.0p-53;
+    };
+    for (long long i = 0; i < text_size / 20; i++) {
+        int topic = next() * nb_topics;
+        for (int j = 0; j < 20; j++) {
+            int w;
+            if (next() < 0.5) {
+                w = topic * topic_size + (int)(next() * topic_size);
+            } else {
+                // Rank r with a probability close to 1 / r, spread over the topics
+                int rank = (int)std::exp(next() * std::log(vocabulary_size));
+                w = (long long)(rank - 1) * 7919 % vocabulary_size;
+            }
+            os << word(w) << (j == 19 ? '\n' : ' ');
+        }
+    }
+}
+
+double quality(const Vocabulary& vocabulary, const Matrix<float>& embeddings) {
+    using namespace std;
+    int n = vocabulary.size();
+    Matrix<float> normalized = embeddings;
+    for (int i = 0; i < n; i++) {
+        float norm = 0;
+        for (float x : normalized[i]) norm += x * x;
+        norm = sqrt(norm) + 1e-12f;
+        for (float& x : normalized[i]) x /= norm;
+    }
+    // -1 for the words that are not of the text, as the end of sentence
+    vector<int> topic(n, -1);
+    for (int i = 0; i < n; i++) {
+        string_view w = vocabulary[i];
+        if (w.starts_with('t')) topic[i] = stoi(string(w.substr(1, w.find('w') - 1)));
+    }
+    int right = 0, words = 0;
+    for (int i = 0; i < n; i++) {
+        if (topic[i] < 0) continue;
+        words++;
+        int nearest = -1;
+        float best = -2;
+        for (int j = 0; j < n; j++) {
+            if (j == i) continue;
+            float dot = 0;
+            for (int d = 0; d < normalized.cols; d++) dot += normalized[i][d] * normalized[j][d];
+            if (dot > best) {
+                best = dot;
+                nearest = j;
+            }
+        }
+        right += topic[nearest] == topic[i];
+    }
+    return (double)right / words;
+}
+
+int main(int argc, char* argv[]) {
+    using namespace std;
+    namespace fs = std::filesystem;
+    if (argc < 2) {
+        cout << "usage: bench_training TRAINER [OPTIONS...]\n";
+        return EXIT_FAILURE;
+    }
+    fs::path text = fs::temp_directory_path() / "word2vec_bench_training.txt";
+    if (!fs::exists(text)) write_text(text);
+    fs::path model = fs::temp_directory_path() / ("word2vec_bench_training_" + to_string(getpid()) + ".bin");
+    fs::path log = fs::temp_directory_path() / ("word2vec_bench_training_" + to_string(getpid()) + ".log");
+    vector<string> args{argv[1], "--train", text, "--output", model, "--seed", "1"};
+    for (int i = 2; i < argc; i++) args.emplace_back(argv[i]);
+    auto start = chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        vector<char*> child_args;
+        for (string& a : args) child_args.emplace_back(a.data());
+        child_args.emplace_back(nullptr);
+        execv(child_args[0], child_args.data());
+        _exit(127);
+    }
+    int status = 0;
+    rusage usage{};
+    wait4(pid, &status, 0, &usage);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    ifstream log_is{log};
+    for (string line; getline(log_is, line);) {
+        if (line.find("words/s") != string::npos) cout << line << '\n';
+    }
+    fs::remove(log);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        cout << "the trainer failed\n";
+        return EXIT_FAILURE;
+    }
+    ifstream is{model, ios::binary};
+    const auto [vocabulary, embeddings] = load(is);
+    fs::remove(model);
+    cout << fixed << setprecision(3) << seconds << "s, peak memory " << usage.ru_maxrss / 1024 << "MB, quality "
+         << quality(vocabulary, embeddings) << endl;
+}
@@ -0,0 +1,61 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <map>
+#include <chrono>
+#include <random>
+#include "../vocabulary.hpp"
+
+// Build time and lookups per second of the interned Vocabulary, against the std::map from
+// the words to their ids that distance built before. Arguments: vocabulary size (1000000 by
+// default) and number of lookups (10000000), half of them of words out of the vocabulary.
+
+double since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Words of 3 to 12 letters, made unique by their index
+std::vector<std::string> words(int n, std::mt19937& generator) {
+    std::uniform_int_distribution<int> length(3, 12), letter('a', 'z');
+    std::vector<std::string> res;
+    for (int i = 0; i < n; i++) {
+        std::string w;
+        for (int l = length(generator); l > 0; l--) w += (char)letter(generator);
+        res.emplace_back(w + std::to_string(i));
+    }
+    return res;
+}
+
+int main(int argc, char* argv[]) {
+    using namespace std;
+    int n = argc > 1 ? stoi(argv[1]) : 1000000;
+    long long lookups = argc > 2 ? stoll(argv[2]) : 10000000;
+    mt19937 generator(1);
+    vector<string> vocabulary_words = words(n, generator);
+    // Queries: words of the vocabulary and words that are not, in random order
+    vector<string> queries = words(n, generator);
+    for (string& q : queries) q += "x";
+    queries.insert(queries.end(), vocabulary_words.begin(), vocabulary_words.end());
+    shuffle(queries.begin(), queries.end(), generator);
+    cout << n << " words, " << lookups << " lookups\n";
+
+    auto start = chrono::steady_clock::now();
+    Vocabulary vocabulary;
+    for (const string& w : vocabulary_words) vocabulary.insert(w);
+    double build = since(start);
+    start = chrono::steady_clock::now();
+    long long found = 0;
+    for (long long i = 0; i < lookups; i++) found += vocabulary.find(queries[i % queries.size()]) != -1;
+    double seconds = since(start);
+    cout << "Vocabulary: built in " << build << "s, " << lookups / seconds / 1e6 << "M lookups/s (" << found << " found)\n";
+
+    start = chrono::steady_clock::now();
+    map<string, int> word2index;
+    for (int i = 0; i < n; i++) word2index[vocabulary_words[i]] = i;
+    build = since(start);
+    start = chrono::steady_clock::now();
+    found = 0;
+    for (long long i = 0; i < lookups; i++) found += word2index.count(queries[i % queries.size()]);
+    seconds = since(start);
+    cout << "std::map:   built in " << build << "s, " << lookups / seconds / 1e6 << "M lookups/s (" << found << " found)\n";
+}
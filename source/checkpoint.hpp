@@ -0,0 +1,100 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <optional>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "util.hpp"
+#include "scheduler.hpp"
+#include "rng.hpp"
+#include "sliding_window.hpp"
+
+// Where a training thread is: the item it works on, the block [block, block_end) of it, the
+// words of the block kept by the subsampling around the next position to train on, the
+// learning rate of the block and its random numbers. A checkpoint saves it so that the training resumes in the middle of a block.
+struct WorkerState {
+    Sampler sampler;
+    std::optional<Scheduler::Item> item;
+    bool stolen = false;
+    long long block = 0;
+    long long block_end = 0;
+    SlidingWindow words;
+    long long position = 0;
+    float alpha = 0;
+
+    void save(std::ostream& os) const {
+        sampler.save(os);
+        save_number(os, (char)item.has_value());
+        if (item) {
+            save_number(os, item->iteration);
+            save_number(os, item->begin);
+            save_number(os, item->end);
+        }
+        save_number(os, (char)stolen);
+        save_number(os, block);
+        save_number(os, block_end);
+        words.save(os);
+        save_number(os, position);
+        save_number(os, alpha);
+    }
+
+    void load(std::istream& is) {
+        sampler.load(is);
+        item.reset();
+        if (load_number<char>(is)) {
+            int iteration = load_number<int>(is);
+            long long begin = load_number<long long>(is);
+            long long end = load_number<long long>(is);
+            item = Scheduler::Item{iteration, begin, end};
+        }
+        stolen = load_number<char>(is);
+        block = load_number<long long>(is);
+        block_end = load_number<long long>(is);
+        words.load(is);
+        position = load_number<long long>(is);
+        alpha = load_number<float>(is);
+    }
+};
+
+// Stops the training threads between two positions for the time of a snapshot. The threads
+// check `requested` at each position and park until the snapshot is taken.
+struct Pause {
+    std::atomic<bool> requested = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+    // Threads neither parked nor finished
+    int running = 0;
+
+    // Called by a training thread when requested
+    void park() {
+        std::unique_lock lock{mutex};
+        running--;
+        cv.notify_all();
+        cv.wait(lock, [&] { return !requested; });
+        running++;
+    }
+
+    // Called by a training thread when it has no work left
+    void leave() {
+        std::lock_guard lock{mutex};
+        running--;
+        cv.notify_all();
+    }
+
+    // Returns once all the threads are parked or finished
+    void stop() {
+        std::unique_lock lock{mutex};
+        requested = true;
+        cv.wait(lock, [&] { return running == 0; });
+    }
+
+    void resume() {
+        {
+            std::lock_guard lock{mutex};
+            requested = false;
+        }
+        cv.notify_all();
+    }
+};
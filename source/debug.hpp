@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <concepts>
 
@@ -11,8 +12,11 @@ concept iterable = requires(T t) {
     end(t);
 };
 
+template<typename T, typename U>
+std::ostream& operator<<(std::ostream& os, const std::pair<T, U>& p);
+
 template<typename T>
-requires iterable<T> and (!std::same_as<T, std::string>)
+requires iterable<T> and (!std::convertible_to<T, std::string_view>)
 std::ostream& operator<<(std::ostream& os, const T& v) {
     os << '{';
     std::string sep;
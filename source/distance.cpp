@@ -14,17 +14,17 @@
 
 namespace po = boost::program_options;
 
-std::vector<float> normalize(const std::vector<float>& v) {
+std::vector<float> normalize(std::span<const float> v) {
     float norm = std::sqrt(std::accumulate(begin(v), end(v), static_cast<float>(0),
                                                  [](float acc, float x) {
                                                      return acc + x * x;
                                                  }) + std::numeric_limits<float>::epsilon());
-    std::vector<float> res = v;
+    std::vector<float> res(v.begin(), v.end());
     for (auto& x : res) x /= norm;
     return res;
 }
 
-float cosine_similarity(const std::vector<float>& v1, const std::vector<float>& v2) {
+float cosine_similarity(std::span<const float> v1, std::span<const float> v2) {
     auto nv1 = normalize(v1);
     auto nv2 = normalize(v2);
     return inner_product(begin(nv1), end(nv1), begin(nv2), static_cast<float>(0));
@@ -54,23 +54,20 @@ int main(int ac, char* av[]) {
     ifstream is{filename, ios::binary};
     const auto [vocabulary, embeddings] = load(is);
     dbg(embeddings[0]);
-    map<string, int> word2index;
-    for (int i = 0; i < (int)vocabulary.size(); i++) {
-        word2index[vocabulary[i]] = i;
-    }
     int k = vm["neighbors"].as<int>();
     while (true) {
         cout << "Enter word (EXIT to break): ";
         string w; cin >> std::ws >> w;
         if (w == "EXIT") break;
-        if (!word2index.count(w)) {
+        int index = vocabulary.find(w);
+        if (index == -1) {
             cout << "Out of dictionary word!\n";
             continue;
         }
-        const auto& embedding = embeddings[word2index[w]];
-        vector<pair<float, string>> neighbors;
-        for (const auto& w : vocabulary) {
-            neighbors.emplace_back(cosine_similarity(embedding, embeddings[word2index[w]]), w);
+        auto embedding = embeddings[index];
+        vector<pair<float, string_view>> neighbors;
+        for (int i = 0; i < vocabulary.size(); i++) {
+            neighbors.emplace_back(cosine_similarity(embedding, embeddings[i]), vocabulary[i]);
         }
         sort(execution::par_unseq, rbegin(neighbors), rend(neighbors));
         for (int i = 0; i < k; i++) {
@@ -0,0 +1,344 @@
+#pragma once
+
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <optional>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "matrix.hpp"
+
+// 16 bit floating point storage for the model: bf16 (the high half of a float) or IEEE fp16.
+// The rows are converted to fp32 to be computed with, and rounded back when they are written,
+// to the nearest value or stochastically, rounding up with a probability proportional to the
+// distance to the value below, so that small updates are not always lost.
+enum class Precision { fp32, bf16, fp16 };
+
+inline std::optional<Precision> parse_precision(const std::string& name) {
+    if (name == "fp32") return Precision::fp32;
+    if (name == "bf16") return Precision::bf16;
+    if (name == "fp16") return Precision::fp16;
+    return std::nullopt;
+}
+
+namespace half {
+
+inline float bf16_to_float(uint16_t h) {
+    return std::bit_cast<float>((uint32_t)h << 16);
+}
+
+// `noise` is 0x7fff + the lowest bit kept for round to nearest even, random bits for stochastic rounding
+inline uint16_t float_to_bf16(float f, uint32_t noise) {
+    uint32_t x = std::bit_cast<uint32_t>(f);
+    if ((x & 0x7fffffff) > 0x7f800000) return (x >> 16) | 0x40;
+    return (x + noise) >> 16;
+}
+
+inline uint16_t float_to_bf16(float f) {
+    uint32_t x = std::bit_cast<uint32_t>(f);
+    return float_to_bf16(f, 0x7fff + ((x >> 16) & 1));
+}
+
+inline float fp16_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    if (exponent == 0) return std::bit_cast<float>(sign | std::bit_cast<uint32_t>(mantissa * 0x1p-24f));
+    if (exponent == 31) return std::bit_cast<float>(sign | 0x7f800000 | mantissa << 13);
+    return std::bit_cast<float>(sign | (exponent + 112) << 23 | mantissa << 13);
+}
+
+// `noise` is as for bf16, on the 13 bits dropped from the mantissa
+inline uint16_t float_to_fp16(float f, uint32_t noise) {
+    uint32_t x = std::bit_cast<uint32_t>(f);
+    uint16_t sign = (x >> 16) & 0x8000;
+    uint32_t abs = x & 0x7fffffff;
+    if (abs > 0x7f800000) return sign | 0x7e00;
+    // Below the smallest normal fp16, the values are multiples of 2^-24
+    if (abs < 0x38800000) return sign | (uint16_t)std::nearbyint(std::bit_cast<float>(abs) * 0x1p24f);
+    uint32_t rounded = (abs + noise) >> 13;
+    // Too large values, infinity included, become infinity
+    if (rounded >= (0x47800000 >> 13)) return sign | 0x7c00;
+    return sign | (rounded - (0x38000000 >> 13));
+}
+
+inline uint16_t float_to_fp16(float f) {
+    uint32_t x = std::bit_cast<uint32_t>(f);
+    return float_to_fp16(f, 0xfff + ((x >> 13) & 1));
+}
+
+// Random bits for stochastic rounding, xorshift generator of the thread
+inline uint32_t random_bits() {
+    thread_local uint64_t state = 0x9e3779b97f4a7c15ULL ^ (uint64_t)(uintptr_t)&state;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state >> 32;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx,f16c")))
+inline void fp16_to_float_f16c(const uint16_t* in, float* out, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))));
+    }
+    for (; i < n; i++) out[i] = fp16_to_float(in[i]);
+}
+
+__attribute__((target("avx,f16c")))
+inline void float_to_fp16_f16c(const float* in, uint16_t* out, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), h);
+    }
+    for (; i < n; i++) out[i] = float_to_fp16(in[i]);
+}
+
+// bf16 rows 8 values at a time. The stochastic rounding draws its noise from 8 xorshift
+// generators, one per lane.
+__attribute__((target("avx2")))
+inline void bf16_to_float_avx2(const uint16_t* in, float* out, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+        _mm256_storeu_ps(out + i, _mm256_castsi256_ps(_mm256_slli_epi32(x, 16)));
+    }
+    for (; i < n; i++) out[i] = bf16_to_float(in[i]);
+}
+
+__attribute__((target("avx2")))
+inline void bf16_add_avx2(const uint16_t* in, float* out, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_castsi256_ps(_mm256_slli_epi32(x, 16))));
+    }
+    for (; i < n; i++) out[i] += bf16_to_float(in[i]);
+}
+
+__attribute__((target("avx2")))
+inline void float_to_bf16_avx2(const float* in, uint16_t* out, int n, bool stochastic) {
+    alignas(32) thread_local uint32_t lanes[8] = {0x9e3779b9, 0x7f4a7c15, 0xf39cc060, 0x5ced0e1b,
+                                                  0x2545f491, 0x4f6cdd1d, 0x1b873593, 0xcc9e2d51};
+    __m256i state = _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes));
+    const __m256i low = _mm256_set1_epi32(0xffff);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        __m256i noise;
+        if (stochastic) {
+            state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 13));
+            state = _mm256_xor_si256(state, _mm256_srli_epi32(state, 17));
+            state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 5));
+            noise = _mm256_and_si256(state, low);
+        } else {
+            __m256i odd = _mm256_and_si256(_mm256_srli_epi32(x, 16), _mm256_set1_epi32(1));
+            noise = _mm256_add_epi32(_mm256_set1_epi32(0x7fff), odd);
+        }
+        __m256i rounded = _mm256_srli_epi32(_mm256_add_epi32(x, noise), 16);
+        // NaNs stay quiet NaNs instead of being rounded to infinity
+        __m256i nan = _mm256_cmpgt_epi32(_mm256_and_si256(x, _mm256_set1_epi32(0x7fffffff)), _mm256_set1_epi32(0x7f800000));
+        __m256i quiet = _mm256_or_si256(_mm256_srli_epi32(x, 16), _mm256_set1_epi32(0x40));
+        rounded = _mm256_blendv_epi8(rounded, quiet, nan);
+        // packus works within 128 bit lanes, the permutation brings the two halves together
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(rounded, rounded), 0b1000);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_castsi256_si128(packed));
+    }
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), state);
+    for (; i < n; i++) out[i] = stochastic ? float_to_bf16(in[i], random_bits() & 0xffff) : float_to_bf16(in[i]);
+}
+
+// fp16 rows 8 values at a time, with the rounding of float_to_fp16: F16C only rounds to nearest.
+// The noise of the stochastic rounding comes from 8 xorshift generators, as for bf16.
+__attribute__((target("avx2")))
+inline void float_to_fp16_avx2(const float* in, uint16_t* out, int n, bool stochastic) {
+    alignas(32) thread_local uint32_t lanes[8] = {0x85ebca6b, 0xc2b2ae35, 0x27d4eb2f, 0x165667b1,
+                                                  0xd3a2646c, 0xfd7046c5, 0xb55a4f09, 0x9e3779b9};
+    __m256i state = _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes));
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        __m256i sign = _mm256_and_si256(_mm256_srli_epi32(x, 16), _mm256_set1_epi32(0x8000));
+        __m256i abs = _mm256_and_si256(x, _mm256_set1_epi32(0x7fffffff));
+        __m256i noise;
+        if (stochastic) {
+            state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 13));
+            state = _mm256_xor_si256(state, _mm256_srli_epi32(state, 17));
+            state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 5));
+            noise = _mm256_and_si256(state, _mm256_set1_epi32(0x1fff));
+        } else {
+            __m256i odd = _mm256_and_si256(_mm256_srli_epi32(x, 13), _mm256_set1_epi32(1));
+            noise = _mm256_add_epi32(_mm256_set1_epi32(0xfff), odd);
+        }
+        __m256i rounded = _mm256_srli_epi32(_mm256_add_epi32(abs, noise), 13);
+        __m256i res = _mm256_sub_epi32(rounded, _mm256_set1_epi32(0x38000000 >> 13));
+        // Too large values, infinity included, become infinity
+        __m256i overflow = _mm256_cmpgt_epi32(rounded, _mm256_set1_epi32((0x47800000 >> 13) - 1));
+        res = _mm256_blendv_epi8(res, _mm256_set1_epi32(0x7c00), overflow);
+        // Below the smallest normal fp16, the values are multiples of 2^-24, rounded to nearest
+        __m256i subnormal = _mm256_cmpgt_epi32(_mm256_set1_epi32(0x38800000), abs);
+        __m256i multiple = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_castsi256_ps(abs), _mm256_set1_ps(0x1p24f)));
+        res = _mm256_blendv_epi8(res, multiple, subnormal);
+        __m256i nan = _mm256_cmpgt_epi32(abs, _mm256_set1_epi32(0x7f800000));
+        res = _mm256_blendv_epi8(res, _mm256_set1_epi32(0x7e00), nan);
+        res = _mm256_or_si256(res, sign);
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(res, res), 0b1000);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_castsi256_si128(packed));
+    }
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), state);
+    for (; i < n; i++) out[i] = stochastic ? float_to_fp16(in[i], random_bits() & 0x1fff) : float_to_fp16(in[i]);
+}
+
+__attribute__((target("avx,f16c")))
+inline void fp16_add_f16c(const uint16_t* in, float* out, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), x));
+    }
+    for (; i < n; i++) out[i] += fp16_to_float(in[i]);
+}
+
+inline bool has_avx2() {
+    static const bool res = __builtin_cpu_supports("avx2");
+    return res;
+}
+
+inline bool has_f16c() {
+    static const bool res = __builtin_cpu_supports("f16c") && __builtin_cpu_supports("avx");
+    return res;
+}
+#endif
+
+}
+
+// Matrix of 16 bit values, read and written by rows of floats
+struct HalfMatrix {
+    Precision precision = Precision::fp32;
+    bool stochastic = false;
+    // Other threads may write the rows at the same time (--hogwild): they are copied by relaxed
+    // atomic accesses, and converted from and to the copy
+    bool relaxed = false;
+    Matrix<uint16_t> values;
+
+    HalfMatrix() = default;
+
+    HalfMatrix(const Matrix<float>& m, Precision precision, bool stochastic)
+        : precision(precision), stochastic(stochastic), values(m.rows, m.cols) {
+        for (int i = 0; i < m.rows; i++) store(i, m.row(i));
+    }
+
+    // Zeros
+    HalfMatrix(int rows, int cols, Precision precision, bool stochastic)
+        : precision(precision), stochastic(stochastic), values(rows, cols) {}
+
+    bool empty() const {
+        return values.empty();
+    }
+
+    int cols() const {
+        return values.cols;
+    }
+
+    int size() const {
+        return values.rows;
+    }
+
+    // Row i in fp32, to write it
+    std::vector<float> operator[](int i) const {
+        std::vector<float> res(values.cols);
+        load(i, res.data());
+        return res;
+    }
+
+    Matrix<float> to_float() const {
+        Matrix<float> res(values.rows, values.cols);
+        for (int i = 0; i < values.rows; i++) load(i, res.row(i));
+        return res;
+    }
+
+    // Row i, or its relaxed copy
+    const uint16_t* source(int i) const {
+        if (!relaxed) return values.row(i);
+        thread_local std::vector<uint16_t> copy;
+        copy.resize(values.cols);
+        relaxed_load(values.row(i), copy.data(), values.cols);
+        return copy.data();
+    }
+
+    void load(int i, float* out) const {
+        const uint16_t* in = source(i);
+        int n = values.cols;
+        if (precision == Precision::bf16) {
+#if defined(__x86_64__) || defined(__i386__)
+            if (half::has_avx2()) return half::bf16_to_float_avx2(in, out, n);
+#endif
+            for (int j = 0; j < n; j++) out[j] = half::bf16_to_float(in[j]);
+            return;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        if (half::has_f16c()) return half::fp16_to_float_f16c(in, out, n);
+#endif
+        for (int j = 0; j < n; j++) out[j] = half::fp16_to_float(in[j]);
+    }
+
+    // out += row i
+    void add_to(int i, float* out) const {
+        const uint16_t* in = source(i);
+        int n = values.cols;
+        if (precision == Precision::bf16) {
+#if defined(__x86_64__) || defined(__i386__)
+            if (half::has_avx2()) return half::bf16_add_avx2(in, out, n);
+#endif
+            for (int j = 0; j < n; j++) out[j] += half::bf16_to_float(in[j]);
+            return;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        if (half::has_f16c()) return half::fp16_add_f16c(in, out, n);
+#endif
+        for (int j = 0; j < n; j++) out[j] += half::fp16_to_float(in[j]);
+    }
+
+    void store(int i, const float* in) {
+        int n = values.cols;
+        if (relaxed) {
+            thread_local std::vector<uint16_t> copy;
+            copy.resize(n);
+            convert(in, copy.data(), n);
+            relaxed_store(values.row(i), copy.data(), n);
+        } else {
+            convert(in, values.row(i), n);
+        }
+    }
+
+    // Rounds n floats to 16 bits
+    void convert(const float* in, uint16_t* out, int n) const {
+        if (precision == Precision::bf16) {
+#if defined(__x86_64__) || defined(__i386__)
+            if (half::has_avx2()) return half::float_to_bf16_avx2(in, out, n, stochastic);
+#endif
+            if (stochastic) {
+                for (int j = 0; j < n; j++) out[j] = half::float_to_bf16(in[j], half::random_bits() & 0xffff);
+            } else {
+                for (int j = 0; j < n; j++) out[j] = half::float_to_bf16(in[j]);
+            }
+            return;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        if (stochastic && half::has_avx2()) return half::float_to_fp16_avx2(in, out, n, true);
+#endif
+        if (stochastic) {
+            for (int j = 0; j < n; j++) out[j] = half::float_to_fp16(in[j], half::random_bits() & 0x1fff);
+            return;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        if (half::has_f16c()) return half::float_to_fp16_f16c(in, out, n);
+#endif
+        for (int j = 0; j < n; j++) out[j] = half::float_to_fp16(in[j]);
+    }
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+#include <span>
+#include <numeric>
+#include <algorithm>
+
+// Huffman tree over the words, for hierarchical softmax. A word of count c gets a code of
+// about log2(total / c) bits. The V - 1 internal nodes are numbered from 0, the root being
+// V - 2, and `points` gives the internal nodes from the root down to each word, `codes` the
+// branch taken at each of them.
+struct HuffmanTree {
+    // The path of word i is [offsets[i], offsets[i + 1]) in codes and points
+    std::vector<long long> offsets{0};
+    std::vector<char> codes;
+    std::vector<int> points;
+
+    HuffmanTree() = default;
+
+    template<typename T>
+    explicit HuffmanTree(const std::vector<T>& counts) {
+        using namespace std;
+        int n = counts.size();
+        if (n < 2) {
+            offsets.assign(n + 1, 0);
+            return;
+        }
+        // Leaves by increasing count. The internal nodes are made by increasing count too,
+        // so the two smallest nodes are always at the front of one of the two queues.
+        vector<int> leaves(n);
+        iota(leaves.begin(), leaves.end(), 0);
+        stable_sort(leaves.begin(), leaves.end(), [&](int i, int j) { return counts[i] < counts[j]; });
+        // Nodes 0 to n - 1 are the words, n + i is internal node i
+        vector<long long> count(2 * n - 1);
+        vector<int> parent(2 * n - 1);
+        vector<char> branch(2 * n - 1);
+        for (int i = 0; i < n; i++) count[i] = counts[i];
+        int next_leaf = 0, next_node = n;
+        auto smallest = [&](int created) {
+            if (next_leaf < n && (next_node == created || count[leaves[next_leaf]] <= count[next_node])) {
+                return leaves[next_leaf++];
+            }
+            return next_node++;
+        };
+        for (int created = n; created < 2 * n - 1; created++) {
+            int a = smallest(created);
+            int b = smallest(created);
+            count[created] = count[a] + count[b];
+            parent[a] = parent[b] = created;
+            branch[a] = 0;
+            branch[b] = 1;
+        }
+        vector<long long> lengths(n);
+        for (int i = 0; i < n; i++) {
+            for (int node = i; node != 2 * n - 2; node = parent[node]) lengths[i]++;
+        }
+        offsets.resize(n + 1);
+        partial_sum(lengths.begin(), lengths.end(), offsets.begin() + 1);
+        codes.resize(offsets[n]);
+        points.resize(offsets[n]);
+        for (int i = 0; i < n; i++) {
+            // Filled from the word up to the root
+            long long k = offsets[i + 1];
+            for (int node = i; node != 2 * n - 2; node = parent[node]) {
+                k--;
+                codes[k] = branch[node];
+                points[k] = parent[node] - n;
+            }
+        }
+    }
+
+    // Number of internal nodes
+    int size() const {
+        return std::max(0, (int)offsets.size() - 2);
+    }
+
+    std::span<const char> code(int word) const {
+        return {codes.data() + offsets[word], codes.data() + offsets[word + 1]};
+    }
+
+    std::span<const int> path(int word) const {
+        return {points.data() + offsets[word], points.data() + offsets[word + 1]};
+    }
+};
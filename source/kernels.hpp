@@ -0,0 +1,480 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define W2V_X86 1
+#endif
+#include "debug.hpp"
+
+// Vector kernels of the training loop, in scalar, AVX2 and AVX-512 versions.
+// The best version supported by the processor is chosen once, the first time Kernels::get is called.
+// The pointers may be unaligned and n is any size, the rows of a Matrix being just the fast case.
+namespace kernels::scalar {
+
+inline float dot(const float* x, const float* y, int n) {
+    float res = 0;
+    for (int i = 0; i < n; i++) res += x[i] * y[i];
+    return res;
+}
+
+// y += a * x
+inline void axpy(float a, const float* x, float* y, int n) {
+    for (int i = 0; i < n; i++) y[i] += a * x[i];
+}
+
+// x *= a
+inline void scale(float a, float* x, int n) {
+    for (int i = 0; i < n; i++) x[i] *= a;
+}
+
+// Update for one output row, in a single pass over the row:
+// neu1e += g * row, then row += h * neu1
+inline void output_update(float g, float h, const float* neu1, float* neu1e, float* row, int n) {
+    for (int i = 0; i < n; i++) {
+        float r = row[i];
+        neu1e[i] += g * r;
+        row[i] = r + h * neu1[i];
+    }
+}
+
+// res[j] = x . y[j] for 4 vectors y[j], reading x once
+inline void dot4(const float* x, const float* const* y, int n, float* res) {
+    for (int j = 0; j < 4; j++) res[j] = dot(x, y[j], n);
+}
+
+// y += a[0] * x[0] + ... + a[3] * x[3], reading and writing y once
+inline void axpy4(const float* a, const float* const* x, float* y, int n) {
+    for (int i = 0; i < n; i++) y[i] += a[0] * x[0][i] + a[1] * x[1][i] + a[2] * x[2][i] + a[3] * x[3][i];
+}
+
+}
+
+// The scalar loops through relaxed atomic accesses, for the rows that other threads update at the
+// same time with --hogwild: the same moves as plain ones on x86, without the data race, but
+// element by element. The rows of the model are y of dot, x and y of axpy and axpy4, and row of
+// output_update; the other vectors belong to the thread and are accessed normally.
+namespace kernels::relaxed {
+
+inline float load(const float& x) {
+    return std::atomic_ref<float>(const_cast<float&>(x)).load(std::memory_order_relaxed);
+}
+
+inline void store(float& x, float value) {
+    std::atomic_ref<float>(x).store(value, std::memory_order_relaxed);
+}
+
+// With 4 partial sums, so that the additions do not wait for each other
+inline float dot(const float* x, const float* y, int n) {
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += x[i] * load(y[i]);
+        s1 += x[i + 1] * load(y[i + 1]);
+        s2 += x[i + 2] * load(y[i + 2]);
+        s3 += x[i + 3] * load(y[i + 3]);
+    }
+    for (; i < n; i++) s0 += x[i] * load(y[i]);
+    return (s0 + s1) + (s2 + s3);
+}
+
+inline void axpy(float a, const float* x, float* y, int n) {
+    for (int i = 0; i < n; i++) store(y[i], load(y[i]) + a * load(x[i]));
+}
+
+inline void output_update(float g, float h, const float* neu1, float* neu1e, float* row, int n) {
+    for (int i = 0; i < n; i++) {
+        float r = load(row[i]);
+        neu1e[i] += g * r;
+        store(row[i], r + h * neu1[i]);
+    }
+}
+
+inline void dot4(const float* x, const float* const* y, int n, float* res) {
+    for (int j = 0; j < 4; j++) res[j] = dot(x, y[j], n);
+}
+
+inline void axpy4(const float* a, const float* const* x, float* y, int n) {
+    for (int i = 0; i < n; i++) {
+        store(y[i], load(y[i]) + a[0] * load(x[0][i]) + a[1] * load(x[1][i]) + a[2] * load(x[2][i]) + a[3] * load(x[3][i]));
+    }
+}
+
+}
+
+#ifdef W2V_X86
+namespace kernels::avx2 {
+
+__attribute__((target("avx2,fma")))
+inline float dot(const float* x, const float* y, int n) {
+    __m256 s0 = _mm256_setzero_ps();
+    __m256 s1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), s0);
+        s1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8), s1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), s0);
+    }
+    __m256 s = _mm256_add_ps(s0, s1);
+    __m128 h = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+    h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+    h = _mm_add_ss(h, _mm_movehdup_ps(h));
+    float res = _mm_cvtss_f32(h);
+    for (; i < n; i++) res += x[i] * y[i];
+    return res;
+}
+
+__attribute__((target("avx2,fma")))
+inline void axpy(float a, const float* x, float* y, int n) {
+    __m256 va = _mm256_set1_ps(a);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    for (; i < n; i++) y[i] += a * x[i];
+}
+
+__attribute__((target("avx2,fma")))
+inline void scale(float a, float* x, int n) {
+    __m256 va = _mm256_set1_ps(a);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(x + i, _mm256_mul_ps(va, _mm256_loadu_ps(x + i)));
+    }
+    for (; i < n; i++) x[i] *= a;
+}
+
+__attribute__((target("avx2,fma")))
+inline void output_update(float g, float h, const float* neu1, float* neu1e, float* row, int n) {
+    __m256 vg = _mm256_set1_ps(g);
+    __m256 vh = _mm256_set1_ps(h);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 r = _mm256_loadu_ps(row + i);
+        _mm256_storeu_ps(neu1e + i, _mm256_fmadd_ps(vg, r, _mm256_loadu_ps(neu1e + i)));
+        _mm256_storeu_ps(row + i, _mm256_fmadd_ps(vh, _mm256_loadu_ps(neu1 + i), r));
+    }
+    for (; i < n; i++) {
+        float r = row[i];
+        neu1e[i] += g * r;
+        row[i] = r + h * neu1[i];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline float sum(__m256 s) {
+    __m128 h = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+    h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+    h = _mm_add_ss(h, _mm_movehdup_ps(h));
+    return _mm_cvtss_f32(h);
+}
+
+__attribute__((target("avx2,fma")))
+inline void dot4(const float* x, const float* const* y, int n, float* res) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 vx = _mm256_loadu_ps(x + i);
+        s0 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(y[0] + i), s0);
+        s1 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(y[1] + i), s1);
+        s2 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(y[2] + i), s2);
+        s3 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(y[3] + i), s3);
+    }
+    res[0] = sum(s0);
+    res[1] = sum(s1);
+    res[2] = sum(s2);
+    res[3] = sum(s3);
+    for (; i < n; i++) {
+        for (int j = 0; j < 4; j++) res[j] += x[i] * y[j][i];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void axpy4(const float* a, const float* const* x, float* y, int n) {
+    __m256 a0 = _mm256_set1_ps(a[0]), a1 = _mm256_set1_ps(a[1]);
+    __m256 a2 = _mm256_set1_ps(a[2]), a3 = _mm256_set1_ps(a[3]);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 vy = _mm256_loadu_ps(y + i);
+        vy = _mm256_fmadd_ps(a0, _mm256_loadu_ps(x[0] + i), vy);
+        vy = _mm256_fmadd_ps(a1, _mm256_loadu_ps(x[1] + i), vy);
+        vy = _mm256_fmadd_ps(a2, _mm256_loadu_ps(x[2] + i), vy);
+        vy = _mm256_fmadd_ps(a3, _mm256_loadu_ps(x[3] + i), vy);
+        _mm256_storeu_ps(y + i, vy);
+    }
+    for (; i < n; i++) y[i] += a[0] * x[0][i] + a[1] * x[1][i] + a[2] * x[2][i] + a[3] * x[3][i];
+}
+
+}
+
+namespace kernels::avx512 {
+
+// Mask of the first n lanes, n < 16
+__attribute__((target("avx512f")))
+inline __mmask16 tail(int n) {
+    return (__mmask16)((1u << n) - 1);
+}
+
+// Sum of the lanes, by halves. _mm512_reduce_add_ps, and even the casts to 256 bits, extract the
+// halves into an undefined vector, which makes GCC 12 warn: the zero-masked extractions do not.
+__attribute__((target("avx512f")))
+inline float sum(__m512 s) {
+    __m256 low = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xf, _mm512_castps_pd(s), 0));
+    __m256 high = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xf, _mm512_castps_pd(s), 1));
+    // As avx2::sum, which is not inlined into the avx512 functions
+    __m256 s8 = _mm256_add_ps(low, high);
+    __m128 h = _mm_add_ps(_mm256_castps256_ps128(s8), _mm256_extractf128_ps(s8, 1));
+    h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+    h = _mm_add_ss(h, _mm_movehdup_ps(h));
+    return _mm_cvtss_f32(h);
+}
+
+__attribute__((target("avx512f")))
+inline float dot(const float* x, const float* y, int n) {
+    __m512 s0 = _mm512_setzero_ps();
+    __m512 s1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        s0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), s0);
+        s1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16), s1);
+    }
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), s0);
+    }
+    if (i < n) {
+        __mmask16 m = tail(n - i);
+        s1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i), s1);
+    }
+    return sum(_mm512_add_ps(s0, s1));
+}
+
+__attribute__((target("avx512f")))
+inline void axpy(float a, const float* x, float* y, int n) {
+    __m512 va = _mm512_set1_ps(a);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(va, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+    }
+    if (i < n) {
+        __mmask16 m = tail(n - i);
+        _mm512_mask_storeu_ps(y + i, m, _mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i)));
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void scale(float a, float* x, int n) {
+    __m512 va = _mm512_set1_ps(a);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(x + i, _mm512_mul_ps(va, _mm512_loadu_ps(x + i)));
+    }
+    if (i < n) {
+        __mmask16 m = tail(n - i);
+        _mm512_mask_storeu_ps(x + i, m, _mm512_mul_ps(va, _mm512_maskz_loadu_ps(m, x + i)));
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void output_update(float g, float h, const float* neu1, float* neu1e, float* row, int n) {
+    __m512 vg = _mm512_set1_ps(g);
+    __m512 vh = _mm512_set1_ps(h);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 r = _mm512_loadu_ps(row + i);
+        _mm512_storeu_ps(neu1e + i, _mm512_fmadd_ps(vg, r, _mm512_loadu_ps(neu1e + i)));
+        _mm512_storeu_ps(row + i, _mm512_fmadd_ps(vh, _mm512_loadu_ps(neu1 + i), r));
+    }
+    if (i < n) {
+        __mmask16 m = tail(n - i);
+        __m512 r = _mm512_maskz_loadu_ps(m, row + i);
+        _mm512_mask_storeu_ps(neu1e + i, m, _mm512_fmadd_ps(vg, r, _mm512_maskz_loadu_ps(m, neu1e + i)));
+        _mm512_mask_storeu_ps(row + i, m, _mm512_fmadd_ps(vh, _mm512_maskz_loadu_ps(m, neu1 + i), r));
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void dot4(const float* x, const float* const* y, int n, float* res) {
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    __m512 s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+    for (int i = 0; i < n; i += 16) {
+        __mmask16 m = n - i >= 16 ? (__mmask16)0xffff : tail(n - i);
+        __m512 vx = _mm512_maskz_loadu_ps(m, x + i);
+        s0 = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(m, y[0] + i), s0);
+        s1 = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(m, y[1] + i), s1);
+        s2 = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(m, y[2] + i), s2);
+        s3 = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(m, y[3] + i), s3);
+    }
+    res[0] = sum(s0);
+    res[1] = sum(s1);
+    res[2] = sum(s2);
+    res[3] = sum(s3);
+}
+
+__attribute__((target("avx512f")))
+inline void axpy4(const float* a, const float* const* x, float* y, int n) {
+    __m512 a0 = _mm512_set1_ps(a[0]), a1 = _mm512_set1_ps(a[1]);
+    __m512 a2 = _mm512_set1_ps(a[2]), a3 = _mm512_set1_ps(a[3]);
+    for (int i = 0; i < n; i += 16) {
+        __mmask16 m = n - i >= 16 ? (__mmask16)0xffff : tail(n - i);
+        __m512 vy = _mm512_maskz_loadu_ps(m, y + i);
+        vy = _mm512_fmadd_ps(a0, _mm512_maskz_loadu_ps(m, x[0] + i), vy);
+        vy = _mm512_fmadd_ps(a1, _mm512_maskz_loadu_ps(m, x[1] + i), vy);
+        vy = _mm512_fmadd_ps(a2, _mm512_maskz_loadu_ps(m, x[2] + i), vy);
+        vy = _mm512_fmadd_ps(a3, _mm512_maskz_loadu_ps(m, x[3] + i), vy);
+        _mm512_mask_storeu_ps(y + i, m, vy);
+    }
+}
+
+}
+#endif
+
+struct Kernels {
+    const char* name;
+    float (*dot)(const float* x, const float* y, int n);
+    void (*axpy)(float a, const float* x, float* y, int n);
+    void (*scale)(float a, float* x, int n);
+    void (*output_update)(float g, float h, const float* neu1, float* neu1e, float* row, int n);
+    void (*dot4)(const float* x, const float* const* y, int n, float* res);
+    void (*axpy4)(const float* a, const float* const* x, float* y, int n);
+
+    // Columns of the vectors handled at once by the matrix products, so that the
+    // pieces of the rows they reuse stay in the L1 cache
+    static constexpr int tile = 512;
+
+    static Kernels scalar() {
+        namespace k = kernels::scalar;
+        return {"scalar", k::dot, k::axpy, k::scale, k::output_update, k::dot4, k::axpy4};
+    }
+
+    static Kernels relaxed() {
+        namespace k = kernels::relaxed;
+        return {"relaxed", k::dot, k::axpy, kernels::scalar::scale, k::output_update, k::dot4, k::axpy4};
+    }
+
+    // The versions the processor supports, the best one last
+    static std::vector<Kernels> supported() {
+        std::vector<Kernels> res{scalar()};
+#ifdef W2V_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            namespace k = kernels::avx2;
+            res.push_back({"avx2", k::dot, k::axpy, k::scale, k::output_update, k::dot4, k::axpy4});
+        }
+        if (__builtin_cpu_supports("avx512f")) {
+            namespace k = kernels::avx512;
+            res.push_back({"avx512", k::dot, k::axpy, k::scale, k::output_update, k::dot4, k::axpy4});
+        }
+#endif
+        return res;
+    }
+
+    static Kernels select() {
+        return supported().back();
+    }
+
+    // c[i][j] = a[i] . b[j], for m rows a[i] and n rows b[j] of d floats.
+    // Each row of a is read once for 4 rows of b.
+    void gemm_nt(int m, int n, int d, const float* a, size_t lda, const float* b, size_t ldb,
+                 float* c, size_t ldc) const {
+        for (int i = 0; i < m; i++) {
+            for (int j = 0; j < n; j++) c[i * ldc + j] = 0;
+        }
+        for (int t = 0; t < d; t += tile) {
+            int width = std::min(tile, d - t);
+            for (int i = 0; i < m; i++) {
+                const float* x = a + i * lda + t;
+                float* res = c + i * ldc;
+                int j = 0;
+                for (; j + 4 <= n; j += 4) {
+                    const float* y[4] = {b + j * ldb + t, b + (j + 1) * ldb + t, b + (j + 2) * ldb + t, b + (j + 3) * ldb + t};
+                    float partial[4];
+                    dot4(x, y, width, partial);
+                    for (int l = 0; l < 4; l++) res[j + l] += partial[l];
+                }
+                for (; j < n; j++) res[j] += dot(x, b + j * ldb + t, width);
+            }
+        }
+    }
+
+    // c[i] += sum of a[i][j] * b[j], for m rows c[i] and n rows b[j] of d floats.
+    // Each row of c is read and written once for 4 rows of b.
+    void gemm_nn(int m, int n, int d, const float* a, size_t lda, const float* b, size_t ldb,
+                 float* c, size_t ldc) const {
+        for (int t = 0; t < d; t += tile) {
+            int width = std::min(tile, d - t);
+            for (int i = 0; i < m; i++) {
+                const float* coefficients = a + i * lda;
+                float* y = c + i * ldc + t;
+                int j = 0;
+                for (; j + 4 <= n; j += 4) {
+                    const float* x[4] = {b + j * ldb + t, b + (j + 1) * ldb + t, b + (j + 2) * ldb + t, b + (j + 3) * ldb + t};
+                    axpy4(coefficients + j, x, y, width);
+                }
+                for (; j < n; j++) axpy(coefficients[j], b + j * ldb + t, y, width);
+            }
+        }
+    }
+
+    // Largest difference of check() allowed, for sums of 100 products in another order
+    static constexpr double tolerance = 1e-5;
+
+    // Largest relative difference with the scalar kernels, on vectors of every size up to 100
+    double check() const {
+        Kernels reference = scalar();
+        double res = 0;
+        auto difference = [&](float x, float y) {
+            res = std::max(res, std::abs((double)x - y) / std::max(1.0, std::abs((double)y)));
+        };
+        for (int n = 0; n <= 100; n++) {
+            std::vector<float> x(n), y(n), z(n);
+            for (int i = 0; i < n; i++) {
+                x[i] = std::sin(i + 1.0f);
+                y[i] = std::cos(3 * i + 2.0f);
+                z[i] = std::sin(7 * i + 5.0f);
+            }
+            difference(dot(x.data(), y.data(), n), reference.dot(x.data(), y.data(), n));
+            std::vector<float> y1 = y, y2 = y, z1 = z, z2 = z;
+            axpy(0.3f, x.data(), y1.data(), n);
+            reference.axpy(0.3f, x.data(), y2.data(), n);
+            scale(0.7f, z1.data(), n);
+            reference.scale(0.7f, z2.data(), n);
+            output_update(0.2f, -0.1f, x.data(), y1.data(), z1.data(), n);
+            reference.output_update(0.2f, -0.1f, x.data(), y2.data(), z2.data(), n);
+            for (int i = 0; i < n; i++) {
+                difference(y1[i], y2[i]);
+                difference(z1[i], z2[i]);
+            }
+            // x, y and z as the rows of a 3 x n matrix, against the first 3, 4 or 5 of its rows repeated
+            std::vector<float> rows;
+            for (int r = 0; r < 5; r++) {
+                const std::vector<float>& v = r % 3 == 0 ? x : r % 3 == 1 ? y : z;
+                rows.insert(rows.end(), v.begin(), v.end());
+            }
+            for (int m = 3; m <= 5; m++) {
+                std::vector<float> c1(3 * m), c2(3 * m), e1(m * n), e2(m * n);
+                gemm_nt(3, m, n, rows.data(), n, rows.data(), n, c1.data(), m);
+                reference.gemm_nt(3, m, n, rows.data(), n, rows.data(), n, c2.data(), m);
+                gemm_nn(m, 3, n, c1.data(), 3, rows.data(), n, e1.data(), n);
+                reference.gemm_nn(m, 3, n, c1.data(), 3, rows.data(), n, e2.data(), n);
+                for (int i = 0; i < 3 * m; i++) difference(c1[i], c2[i]);
+                for (int i = 0; i < m * n; i++) difference(e1[i], e2[i]);
+            }
+        }
+        return res;
+    }
+
+    static const Kernels& get() {
+        static const Kernels kernels = [] {
+            Kernels k = select();
+            dbg(k.name, k.check());
+            return k;
+        }();
+        return kernels;
+    }
+};
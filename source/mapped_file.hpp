@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Owner of an open file descriptor
+struct FileDescriptor {
+    int fd = -1;
+
+    FileDescriptor() = default;
+
+    explicit FileDescriptor(int fd) : fd(fd) {}
+
+    FileDescriptor(FileDescriptor&& other) : fd(std::exchange(other.fd, -1)) {}
+
+    FileDescriptor& operator=(FileDescriptor&& other) {
+        std::swap(fd, other.fd);
+        return *this;
+    }
+
+    ~FileDescriptor() {
+        if (fd != -1) close(fd);
+    }
+
+    bool is_open() const {
+        return fd != -1;
+    }
+};
+
+// Read only mapping of a whole file. The pages are loaded lazily by the
+// kernel, so a file bigger than the memory can be scanned sequentially.
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+    bool ok = false;
+
+    MappedFile(const std::string& filename) : MappedFile(FileDescriptor{open(filename.c_str(), O_RDONLY)}) {}
+
+    // The mapping stays valid once the descriptor is closed
+    explicit MappedFile(const FileDescriptor& file) {
+        struct stat st;
+        if (!file.is_open() || fstat(file.fd, &st) == -1) return;
+        size = st.st_size;
+        if (size > 0) {
+            void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file.fd, 0);
+            if (p == MAP_FAILED) return;
+            madvise(p, size, MADV_SEQUENTIAL);
+            data = static_cast<const char*>(p);
+        }
+        ok = true;
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data) munmap(const_cast<char*>(data), size);
+    }
+
+    bool is_open() const {
+        return ok;
+    }
+
+    std::string_view view() const {
+        return {data, size};
+    }
+};
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <span>
+#include <new>
+#include <utility>
+
+// Row major matrix in a single allocation. Each row is padded to a multiple of 64 bytes,
+// so that every row starts on a cache line and can be loaded with aligned vector loads.
+// The elements, padding included, start at zero.
+template<typename T>
+struct Matrix {
+    static constexpr size_t alignment = 64;
+    T* data = nullptr;
+    int rows = 0;
+    int cols = 0;
+    // Number of elements from the start of a row to the start of the next one
+    size_t stride = 0;
+
+    Matrix() = default;
+
+    Matrix(int rows, int cols)
+        : rows(rows), cols(cols), stride((cols * sizeof(T) + alignment - 1) / alignment * alignment / sizeof(T)) {
+        if (bytes() == 0) return;
+        data = static_cast<T*>(std::aligned_alloc(alignment, bytes()));
+        if (!data) throw std::bad_alloc();
+        std::memset(data, 0, bytes());
+    }
+
+    Matrix(const Matrix& m) : Matrix(m.rows, m.cols) {
+        if (bytes()) std::memcpy(data, m.data, bytes());
+    }
+
+    Matrix(Matrix&& m) noexcept {
+        swap(m);
+    }
+
+    Matrix& operator=(Matrix m) noexcept {
+        swap(m);
+        return *this;
+    }
+
+    ~Matrix() {
+        std::free(data);
+    }
+
+    void swap(Matrix& m) noexcept {
+        std::swap(data, m.data);
+        std::swap(rows, m.rows);
+        std::swap(cols, m.cols);
+        std::swap(stride, m.stride);
+    }
+
+    size_t bytes() const {
+        return rows * stride * sizeof(T);
+    }
+
+    int size() const {
+        return rows;
+    }
+
+    bool empty() const {
+        return rows == 0;
+    }
+
+    T* row(int i) {
+        return data + i * stride;
+    }
+
+    const T* row(int i) const {
+        return data + i * stride;
+    }
+
+    std::span<T> operator[](int i) {
+        return {row(i), (size_t)cols};
+    }
+
+    std::span<const T> operator[](int i) const {
+        return {row(i), (size_t)cols};
+    }
+};
+
+// Copies of rows that other threads may write at the same time, as with --hogwild: relaxed atomic
+// loads and stores, which are the same moves as plain ones on x86, without the data race.
+template<typename T>
+void relaxed_load(const T* row, T* out, int n) {
+    for (int i = 0; i < n; i++) out[i] = std::atomic_ref<T>(const_cast<T&>(row[i])).load(std::memory_order_relaxed);
+}
+
+template<typename T>
+void relaxed_store(T* row, const T* in, int n) {
+    for (int i = 0; i < n; i++) std::atomic_ref<T>(row[i]).store(in[i], std::memory_order_relaxed);
+}
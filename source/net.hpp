@@ -0,0 +1,142 @@
+#pragma once
+
+#include <string>
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Blocking stream sockets between the processes of a distributed training, over TCP
+// ("host:port") or Unix domain sockets ("unix:path").
+struct Socket {
+    int fd = -1;
+
+    Socket() = default;
+
+    explicit Socket(int fd) : fd(fd) {}
+
+    Socket(Socket&& other) : fd(std::exchange(other.fd, -1)) {}
+
+    Socket& operator=(Socket&& other) {
+        std::swap(fd, other.fd);
+        return *this;
+    }
+
+    ~Socket() {
+        if (fd != -1) close(fd);
+    }
+
+    bool ok() const {
+        return fd != -1;
+    }
+
+    bool send(const void* data, size_t bytes) const {
+        const char* p = static_cast<const char*>(data);
+        while (bytes > 0) {
+            ssize_t n = ::send(fd, p, bytes, MSG_NOSIGNAL);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            bytes -= n;
+        }
+        return true;
+    }
+
+    bool receive(void* data, size_t bytes) const {
+        char* p = static_cast<char*>(data);
+        while (bytes > 0) {
+            ssize_t n = ::recv(fd, p, bytes, 0);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            bytes -= n;
+        }
+        return true;
+    }
+
+    // Calls f(family, address, length) with the address of the socket, for each address it may be
+    static bool resolve(const std::string& address, auto f) {
+        if (address.starts_with("unix:")) {
+            sockaddr_un un{};
+            un.sun_family = AF_UNIX;
+            std::string path = address.substr(5);
+            if (path.size() >= sizeof(un.sun_path)) return false;
+            std::strcpy(un.sun_path, path.c_str());
+            return f(AF_UNIX, reinterpret_cast<const sockaddr*>(&un), (socklen_t)sizeof(un));
+        }
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos) return false;
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo* res = nullptr;
+        std::string host = address.substr(0, colon);
+        if (getaddrinfo(host.empty() ? nullptr : host.c_str(), address.substr(colon + 1).c_str(), &hints, &res) != 0) {
+            return false;
+        }
+        bool done = false;
+        for (addrinfo* a = res; a && !done; a = a->ai_next) done = f(a->ai_family, a->ai_addr, a->ai_addrlen);
+        freeaddrinfo(res);
+        return done;
+    }
+
+    // Connects to a listening process, retrying until it listens or `timeout` seconds have passed
+    static Socket connect(const std::string& address, double timeout) {
+        using namespace std::chrono;
+        auto deadline = steady_clock::now() + duration<double>(timeout);
+        while (true) {
+            Socket res;
+            resolve(address, [&](int family, const sockaddr* a, socklen_t length) {
+                Socket s{socket(family, SOCK_STREAM, 0)};
+                if (!s.ok() || ::connect(s.fd, a, length) != 0) return false;
+                res = std::move(s);
+                return true;
+            });
+            if (res.ok()) {
+                res.no_delay();
+                return res;
+            }
+            if (steady_clock::now() > deadline) return res;
+            std::this_thread::sleep_for(milliseconds(100));
+        }
+    }
+
+    void no_delay() const {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+};
+
+struct Listener {
+    Socket socket;
+
+    explicit Listener(const std::string& address) {
+        if (address.starts_with("unix:")) unlink(address.substr(5).c_str());
+        Socket::resolve(address, [&](int family, const sockaddr* a, socklen_t length) {
+            Socket s{::socket(family, SOCK_STREAM, 0)};
+            int one = 1;
+            if (s.ok() && family != AF_UNIX) setsockopt(s.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (!s.ok() || bind(s.fd, a, length) != 0 || listen(s.fd, SOMAXCONN) != 0) return false;
+            socket = std::move(s);
+            return true;
+        });
+    }
+
+    bool ok() const {
+        return socket.ok();
+    }
+
+    Socket accept() const {
+        Socket res{::accept(socket.fd, nullptr, nullptr)};
+        if (res.ok()) res.no_delay();
+        return res;
+    }
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <thread>
+#include <algorithm>
+#include <numeric>
+#include <cstdint>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "util.hpp"
+
+// NUMA nodes of the machine and the CPUs of each, read from /sys, with the memory policy
+// system calls used directly so that libnuma is not needed. On a machine without NUMA
+// information there is a single node with all the CPUs.
+struct Topology {
+    // CPUs of each node with CPUs, and the number the system gives to the node
+    std::vector<std::vector<int>> nodes;
+    std::vector<int> ids;
+
+    Topology() {
+        using namespace std;
+        namespace fs = std::filesystem;
+        error_code ec;
+        // Only the CPUs the process may run on
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, &allowed);
+        }
+        for (int node = 0;; node++) {
+            fs::path path = "/sys/devices/system/node/node" + to_string(node) + "/cpulist";
+            if (!fs::exists(path, ec)) break;
+            ifstream is{path};
+            string list;
+            getline(is, list);
+            vector<int> cpus = parse_cpu_list(list);
+            erase_if(cpus, [&](int cpu) { return cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed); });
+            // Memory only nodes have no CPU to run threads on, nor do nodes outside our cpuset
+            if (cpus.empty()) continue;
+            nodes.emplace_back(std::move(cpus));
+            ids.emplace_back(node);
+        }
+        if (nodes.empty()) {
+            nodes.emplace_back();
+            ids.emplace_back(0);
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &allowed)) nodes[0].emplace_back(cpu);
+            }
+            if (nodes[0].empty()) nodes[0].emplace_back(0);
+        }
+    }
+
+    // "0-3,8,10-11"
+    static std::vector<int> parse_cpu_list(const std::string& list) {
+        std::vector<int> res;
+        std::stringstream ss{list};
+        std::string range;
+        while (std::getline(ss, range, ',')) {
+            if (range.empty()) continue;
+            size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; cpu++) res.emplace_back(cpu);
+        }
+        return res;
+    }
+
+    int size() const {
+        return nodes.size();
+    }
+
+    // Threads go to the nodes in turn, then to the CPUs of their node in turn
+    int node_of_thread(int thread) const {
+        return thread % size();
+    }
+
+    int cpu_of_thread(int thread) const {
+        const std::vector<int>& cpus = nodes[node_of_thread(thread)];
+        return cpus[thread / size() % cpus.size()];
+    }
+
+    // Pins the calling thread
+    static bool pin(int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+
+    static size_t page_size() {
+        static const size_t size = sysconf(_SC_PAGESIZE);
+        return size;
+    }
+
+    // Sets the policy of the pages of [data, data + bytes), moving the pages already there.
+    // The range is widened to whole pages.
+    static bool mbind(const void* data, size_t bytes, int mode, const std::vector<int>& nodes) {
+        if (bytes == 0) return true;
+        uintptr_t begin = reinterpret_cast<uintptr_t>(data) / page_size() * page_size();
+        uintptr_t end = (reinterpret_cast<uintptr_t>(data) + bytes + page_size() - 1) / page_size() * page_size();
+        int max_node = *std::max_element(nodes.begin(), nodes.end());
+        std::vector<unsigned long> mask(max_node / (8 * sizeof(unsigned long)) + 1);
+        for (int node : nodes) mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+        return syscall(SYS_mbind, begin, end - begin, mode, mask.data(), mask.size() * 8 * sizeof(unsigned long) + 1,
+                       MPOL_MF_MOVE) == 0;
+    }
+
+    bool interleave(const void* data, size_t bytes) const {
+        return mbind(data, bytes, MPOL_INTERLEAVE, ids);
+    }
+
+    // Places [data, data + bytes) on the node of the given index
+    bool bind(const void* data, size_t bytes, int node) const {
+        return mbind(data, bytes, MPOL_PREFERRED, {ids[node]});
+    }
+
+    // Number of pages of [data, data + bytes) on each node, by index, from up to `samples` pages
+    std::vector<long long> pages_per_node(const void* data, size_t bytes, int samples = 1024) const {
+        std::vector<long long> res(size());
+        long long nb_pages = (bytes + page_size() - 1) / page_size();
+        if (nb_pages == 0) return res;
+        std::vector<void*> pages;
+        for (long long i = 0; i < std::min<long long>(samples, nb_pages); i++) {
+            uintptr_t p = reinterpret_cast<uintptr_t>(data) + (nb_pages * i / std::min<long long>(samples, nb_pages)) * page_size();
+            pages.emplace_back(reinterpret_cast<void*>(p / page_size() * page_size()));
+        }
+        std::vector<int> status(pages.size(), -1);
+        if (syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr, status.data(), 0) != 0) return res;
+        for (int s : status) {
+            auto it = std::find(ids.begin(), ids.end(), s);
+            if (it != ids.end()) res[it - ids.begin()]++;
+        }
+        return res;
+    }
+};
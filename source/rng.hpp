@@ -0,0 +1,136 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <span>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include "util.hpp"
+#include "alias.hpp"
+
+// xoshiro256** (Blackman and Vigna), as `lanes` generators side by side so that the loop over
+// the lanes is vectorized. The lanes are seeded by splitmix64 from the seed and the number of
+// the stream, so that each thread or slice gets its own sequence and a run can be repeated.
+struct Random {
+    static constexpr int lanes = 8;
+    alignas(64) std::array<std::array<uint64_t, lanes>, 4> s;
+
+    explicit Random(uint64_t seed = 0, uint64_t stream = 0) {
+        this->seed(seed, stream);
+    }
+
+    void seed(uint64_t seed, uint64_t stream = 0) {
+        uint64_t x = seed ^ stream * 0xd1b54a32d192ed03ULL;
+        for (auto& word : s) {
+            for (uint64_t& lane : word) {
+                x += 0x9e3779b97f4a7c15ULL;
+                uint64_t z = x;
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                lane = z ^ (z >> 31);
+            }
+        }
+    }
+
+    // n numbers, n being a multiple of lanes. The lanes are a vector of the compiler, and the
+    // multiplications by 5 and 9 are shifts and additions, which SSE2 and AVX2 have for 64 bits.
+    void fill(uint64_t* out, size_t n) {
+        using Lanes = uint64_t __attribute__((vector_size(lanes * sizeof(uint64_t))));
+        Lanes v[4];
+        std::memcpy(v, s.data(), sizeof(v));
+        for (size_t i = 0; i < n; i += lanes) {
+            Lanes x = (v[1] << 2) + v[1];
+            x = (x << 7) | (x >> 57);
+            x = (x << 3) + x;
+            std::memcpy(out + i, &x, sizeof(x));
+            Lanes t = v[1] << 17;
+            v[2] ^= v[0];
+            v[3] ^= v[1];
+            v[1] ^= v[2];
+            v[0] ^= v[3];
+            v[2] ^= t;
+            v[3] = (v[3] << 45) | (v[3] >> 19);
+        }
+        std::memcpy(s.data(), v, sizeof(v));
+    }
+
+    // Uniform in [0, 1), from the high 24 bits
+    static float uniform(uint64_t bits) {
+        return (bits >> 40) * 0x1p-24f;
+    }
+
+    void save(std::ostream& os) const {
+        for (const auto& word : s) {
+            for (uint64_t lane : word) save_number(os, lane);
+        }
+    }
+
+    void load(std::istream& is) {
+        for (auto& word : s) {
+            for (uint64_t& lane : word) lane = load_number<uint64_t>(is);
+        }
+    }
+};
+
+// Random numbers of a training thread, drawn by blocks ahead of the loops that use them: the
+// coins of the subsampling and the negative samples, `block` at a time.
+struct Sampler {
+    static constexpr int block = 4096;
+    Random random;
+    std::vector<uint64_t> bits;
+    std::vector<float> coins;
+    std::vector<int> negatives;
+    int next_coin = 0;
+    int next_negative = 0;
+
+    explicit Sampler(uint64_t seed = 0, uint64_t stream = 0) : random(seed, stream), bits(block) {}
+
+    // Starts another stream, without allocating
+    void seed(uint64_t seed, uint64_t stream) {
+        random.seed(seed, stream);
+        coins.clear();
+        negatives.clear();
+        next_coin = 0;
+        next_negative = 0;
+    }
+
+    // Uniform in [0, 1), for the subsampling
+    float coin() {
+        if (next_coin == (int)coins.size()) {
+            random.fill(bits.data(), block);
+            coins.resize(block);
+            for (int i = 0; i < block; i++) coins[i] = Random::uniform(bits[i]);
+            next_coin = 0;
+        }
+        return coins[next_coin++];
+    }
+
+    int negative(const AliasTable& unigram) {
+        if (next_negative == (int)negatives.size()) {
+            random.fill(bits.data(), block);
+            negatives.resize(block);
+            for (int i = 0; i < block; i++) negatives[i] = unigram.draw(bits[i]);
+            next_negative = 0;
+        }
+        return negatives[next_negative++];
+    }
+
+    void save(std::ostream& os) const {
+        random.save(os);
+        save_number(os, (int)coins.size() - next_coin);
+        for (int i = next_coin; i < (int)coins.size(); i++) save_number(os, coins[i]);
+        save_number(os, (int)negatives.size() - next_negative);
+        for (int i = next_negative; i < (int)negatives.size(); i++) save_number(os, negatives[i]);
+    }
+
+    void load(std::istream& is) {
+        random.load(is);
+        coins.resize(load_number<int>(is));
+        for (float& c : coins) c = load_number<float>(is);
+        next_coin = 0;
+        negatives.resize(load_number<int>(is));
+        for (int& id : negatives) id = load_number<int>(is);
+        next_negative = 0;
+    }
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <atomic>
+#include <optional>
+#include <algorithm>
+
+// Work of the training threads: `iterations` passes over the text cut in chunks. Thread t owns
+// the chunks of the t-th slice of the text for all the passes, as a range [begin, end) of items
+// packed in one atomic word, item i being chunk i % nb_chunks of the slice in pass
+// i / nb_chunks. The owner takes its items from the front. A thread with nothing left steals
+// items from the back of the other ranges. begin only grows and end only shrinks, so a
+// compare-and-swap on the pair is enough, without locks.
+struct Scheduler {
+    struct Item {
+        int iteration;
+        long long begin;
+        long long end;
+    };
+
+    struct alignas(64) Queue {
+        std::atomic<unsigned long long> range{0};
+        long long first_chunk = 0;
+        long long nb_chunks = 0;
+    };
+
+    long long chunk;
+    long long text_size;
+    std::vector<Queue> queues;
+
+    Scheduler(long long text_size, long long chunk, int iterations, int nb_threads)
+        : chunk(std::max(1LL, chunk)), text_size(text_size), queues(nb_threads) {
+        long long total_chunks = (text_size + this->chunk - 1) / this->chunk;
+        // The number of items of a range must fit in 32 bits
+        while ((total_chunks + nb_threads - 1) / nb_threads * iterations >= (1LL << 32)) {
+            this->chunk *= 2;
+            total_chunks = (text_size + this->chunk - 1) / this->chunk;
+        }
+        for (int t = 0; t < nb_threads; t++) {
+            Queue& q = queues[t];
+            q.first_chunk = total_chunks * t / nb_threads;
+            q.nb_chunks = total_chunks * (t + 1) / nb_threads - q.first_chunk;
+            q.range = pack(0, q.nb_chunks * iterations);
+        }
+    }
+
+    static unsigned long long pack(unsigned long long begin, unsigned long long end) {
+        return begin << 32 | end;
+    }
+
+    Item item(const Queue& q, unsigned long long i) const {
+        long long c = q.first_chunk + (long long)(i % q.nb_chunks);
+        return {(int)(i / q.nb_chunks), c * chunk, std::min(text_size, (c + 1) * chunk)};
+    }
+
+    // Next item of the thread's own range
+    std::optional<Item> pop(int thread) {
+        Queue& q = queues[thread];
+        unsigned long long range = q.range.load();
+        while (true) {
+            unsigned long long begin = range >> 32, end = range & 0xffffffff;
+            if (begin >= end) return std::nullopt;
+            if (q.range.compare_exchange_weak(range, pack(begin + 1, end))) return item(q, begin);
+        }
+    }
+
+    // Last item of the range of another thread, starting with the next threads
+    std::optional<Item> steal(int thread) {
+        int n = queues.size();
+        for (int k = 1; k < n; k++) {
+            Queue& q = queues[(thread + k) % n];
+            unsigned long long range = q.range.load();
+            while (true) {
+                unsigned long long begin = range >> 32, end = range & 0xffffffff;
+                if (begin >= end) break;
+                if (q.range.compare_exchange_weak(range, pack(begin, end - 1))) return item(q, end - 1);
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Start of the next item of the thread's own range, to read it ahead
+    std::optional<Item> peek(int thread) const {
+        const Queue& q = queues[thread];
+        unsigned long long range = q.range.load();
+        unsigned long long begin = range >> 32, end = range & 0xffffffff;
+        if (begin >= end) return std::nullopt;
+        return item(q, begin);
+    }
+};
+
+// Learning rate of word2vec once `words_read` of the `total_words` of all the passes are read,
+// going down linearly from starting_alpha to 1e-4 of it
+inline float learning_rate(float starting_alpha, long long words_read, long long total_words) {
+    return starting_alpha * std::max(1e-4, 1 - words_read / ((double)total_words + 1));
+}
+
+// Slices [begin, end) of `slice` words of the text for word2vec2, the last one being shorter, and
+// among them those of process `rank` out of `world`: one slice out of world
+inline std::vector<std::pair<long long, long long>> make_slices(long long text_size, long long slice, int world, int rank) {
+    std::vector<std::pair<long long, long long>> res;
+    slice = std::max(1LL, slice);
+    long long nb_slices = (text_size + slice - 1) / slice;
+    for (long long i = rank; i < nb_slices; i += world) {
+        res.emplace_back(i * slice, std::min(text_size, (i + 1) * slice));
+    }
+    return res;
+}
+
+// What a training thread did, for the report at the end of the training
+struct WorkerStats {
+    long long chunks = 0;
+    long long stolen = 0;
+    double busy = 0;
+    // Seconds from the start of the training to the end of the thread's last chunk
+    double finished = 0;
+    // Seconds from the start of the training to the first ids the thread trained on, -1 before
+    double first_update = -1;
+    std::vector<float> chunk_seconds;
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+#include <span>
+#include <bit>
+#include "util.hpp"
+#include "rng.hpp"
+
+// Words of a block of the text kept by the subsampling, drawn while the training goes through
+// them instead of being copied out of the block first. Only the last `capacity` kept words are
+// held, in a ring buffer: position p of the subsampled block is ring[p & mask].
+struct SlidingWindow {
+    std::vector<int> ring;
+    long long mask = 0;
+    std::span<const int> ids;
+    // Number of ids of the block read, and of words kept from them
+    long long read = 0;
+    long long end = 0;
+
+    // capacity must cover all the positions used together: 2 * window + 1 for one word
+    void reserve(int capacity) {
+        size_t size = std::bit_ceil((size_t)capacity);
+        if (ring.size() == size) return;
+        ring.assign(size, 0);
+        mask = size - 1;
+    }
+
+    void start(std::span<const int> block) {
+        ids = block;
+        read = 0;
+        end = 0;
+    }
+
+    int operator[](long long position) const {
+        return ring[position & mask];
+    }
+
+    // Reads the block until `position` is kept or the block is done, returns the number of kept words
+    long long fill(long long position, Sampler& sampler, const std::vector<float>& keep) {
+        while (end <= position && read < (long long)ids.size()) {
+            int id = ids[read++];
+            if (keep.empty() || keep[id] >= sampler.coin()) ring[end++ & mask] = id;
+        }
+        return end;
+    }
+
+    // The ids of the block are not saved, they are given again by start or by setting ids
+    void save(std::ostream& os) const {
+        save_number(os, (int)ring.size());
+        for (int id : ring) save_number(os, id);
+        save_number(os, read);
+        save_number(os, end);
+    }
+
+    void load(std::istream& is) {
+        ring.resize(load_number<int>(is));
+        for (int& id : ring) id = load_number<int>(is);
+        mask = (long long)ring.size() - 1;
+        read = load_number<long long>(is);
+        end = load_number<long long>(is);
+    }
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <vector>
+#include <span>
+#include <numeric>
+#include <algorithm>
+
+// Weighted sum of the rows of a matrix, keeping only the rows that were touched.
+// The ids of the rows are sorted, and their values are stored one after the other.
+struct SparseRows {
+    int dim = 0;
+    std::vector<int> ids;
+    std::vector<int> weights;
+    std::vector<float> values;
+
+    SparseRows() = default;
+
+    explicit SparseRows(int dim) : dim(dim) {}
+
+    int size() const {
+        return ids.size();
+    }
+
+    std::span<float> operator[](int k) {
+        return {values.data() + (size_t)k * dim, (size_t)dim};
+    }
+
+    std::span<const float> operator[](int k) const {
+        return {values.data() + (size_t)k * dim, (size_t)dim};
+    }
+
+    void append(int id, int weight, std::span<const float> row) {
+        ids.emplace_back(id);
+        weights.emplace_back(weight);
+        values.insert(values.end(), row.begin(), row.end());
+    }
+
+    // Sum of a and b, in time proportional to the number of rows they touch
+    static SparseRows merge(const SparseRows& a, const SparseRows& b) {
+        SparseRows res(std::max(a.dim, b.dim));
+        res.ids.reserve(a.size() + b.size());
+        res.weights.reserve(a.size() + b.size());
+        res.values.reserve(a.values.size() + b.values.size());
+        int i = 0, j = 0;
+        while (i < a.size() || j < b.size()) {
+            if (j == b.size() || (i < a.size() && a.ids[i] < b.ids[j])) {
+                res.append(a.ids[i], a.weights[i], a[i]);
+                i++;
+            } else if (i == a.size() || b.ids[j] < a.ids[i]) {
+                res.append(b.ids[j], b.weights[j], b[j]);
+                j++;
+            } else {
+                res.append(a.ids[i], a.weights[i] + b.weights[j], a[i]);
+                std::span<float> row = res[res.size() - 1];
+                for (int d = 0; d < res.dim; d++) {
+                    row[d] += b[j][d];
+                }
+                i++;
+                j++;
+            }
+        }
+        return res;
+    }
+};
+
+// Builds a SparseRows by adding rows in any order. `slot` maps every row of the matrix to
+// its position in the rows added so far, and is reset by finish(), so that a thread can
+// reuse the same accumulator for all its slices without clearing a whole vocabulary.
+struct SparseAccumulator {
+    int dim = 0;
+    std::vector<int> slot;
+    SparseRows rows;
+
+    SparseAccumulator() = default;
+
+    SparseAccumulator(int nb_rows, int dim) : dim(dim), slot(nb_rows, -1), rows(dim) {}
+
+    // Values of row id, to add to. Only valid until the next call.
+    float* add(int id, int weight) {
+        int& s = slot[id];
+        if (s == -1) {
+            s = rows.size();
+            rows.ids.emplace_back(id);
+            rows.weights.emplace_back(0);
+            rows.values.resize(rows.values.size() + dim);
+        }
+        rows.weights[s] += weight;
+        return rows[s].data();
+    }
+
+    // The rows added since the last call, sorted by id
+    SparseRows finish() {
+        using namespace std;
+        vector<int> order(rows.size());
+        iota(order.begin(), order.end(), 0);
+        sort(order.begin(), order.end(), [&](int i, int j) { return rows.ids[i] < rows.ids[j]; });
+        SparseRows res(dim);
+        res.ids.reserve(rows.size());
+        res.weights.reserve(rows.size());
+        res.values.reserve(rows.values.size());
+        for (int k : order) {
+            res.append(rows.ids[k], rows.weights[k], rows[k]);
+            slot[rows.ids[k]] = -1;
+        }
+        rows.ids.clear();
+        rows.weights.clear();
+        rows.values.clear();
+        return res;
+    }
+};
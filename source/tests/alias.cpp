@@ -0,0 +1,98 @@
+#include <vector>
+#include <random>
+#include <cmath>
+#include <algorithm>
+#include "check.hpp"
+#include "../alias.hpp"
+#include "../rng.hpp"
+
+// Exact distribution of weights[i]^power
+std::vector<double> expected(const std::vector<long long>& weights, double power) {
+    std::vector<double> res(weights.size());
+    double sum = 0;
+    for (size_t i = 0; i < weights.size(); i++) sum += res[i] = std::pow(weights[i], power);
+    for (double& x : res) x /= sum;
+    return res;
+}
+
+double total_variation(const std::vector<double>& p, const std::vector<double>& q) {
+    double res = 0;
+    for (size_t i = 0; i < p.size(); i++) res += std::abs(p[i] - q[i]) / 2;
+    return res;
+}
+
+// Pearson's statistic of the counts against the expected probabilities, the values expected
+// less than 5 times being merged in one class. Returns the statistic and its degrees of freedom.
+std::pair<double, int> chi_square(const std::vector<long long>& counts, const std::vector<double>& p, long long n) {
+    double res = 0, rest_expected = 0;
+    long long rest_count = 0;
+    int classes = 0;
+    for (size_t i = 0; i < p.size(); i++) {
+        double e = p[i] * n;
+        if (e < 5) {
+            rest_expected += e;
+            rest_count += counts[i];
+            continue;
+        }
+        res += (counts[i] - e) * (counts[i] - e) / e;
+        classes++;
+    }
+    if (rest_expected > 0) {
+        res += (rest_count - rest_expected) * (rest_count - rest_expected) / rest_expected;
+        classes++;
+    }
+    return {res, classes - 1};
+}
+
+// The draws follow the distribution: the statistic stays within 6 standard deviations of its
+// mean, which a correct sampler fails about once in a billion runs (the seeds are fixed anyway)
+void check_draws(const std::vector<long long>& weights, long long n) {
+    using namespace std;
+    AliasTable table{weights, 0.75};
+    vector<double> p = expected(weights, 0.75);
+    CHECK(table.size() == (int)weights.size());
+    CHECK(total_variation(table.distribution(), p) < 1e-6);
+    vector<long long> counts(weights.size());
+    // From 64 random bits, as the samplers of the trainers
+    Random random{42};
+    vector<uint64_t> bits(Sampler::block);
+    long long drawn = 0;
+    for (; drawn < n; drawn += bits.size()) {
+        random.fill(bits.data(), bits.size());
+        for (uint64_t b : bits) counts[table.draw(b)]++;
+    }
+    auto [statistic, freedom] = chi_square(counts, p, drawn);
+    CHECK(statistic < freedom + 6 * sqrt(2.0 * freedom));
+    // From a standard generator
+    fill(counts.begin(), counts.end(), 0);
+    mt19937_64 generator{42};
+    for (long long i = 0; i < n; i++) counts[table(generator)]++;
+    tie(statistic, freedom) = chi_square(counts, p, n);
+    CHECK(statistic < freedom + 6 * sqrt(2.0 * freedom));
+}
+
+int main() {
+    using namespace std;
+    // Zipf's law, the shape of the counts of a text
+    vector<long long> zipf(20000);
+    for (size_t i = 0; i < zipf.size(); i++) zipf[i] = 100000000 / (i + 1);
+    check_draws(zipf, 20000000);
+    check_draws(vector<long long>(1000, 7), 2000000);
+    check_draws({1, 1000000, 1, 3}, 1000000);
+    // A single value is always drawn
+    AliasTable single{vector<long long>{5}, 0.75};
+    CHECK(single.draw(~0ULL) == 0 && single.draw(0) == 0);
+    // A sampler that draws another value than the one of its weights must fail the check
+    vector<long long> counts(zipf.size());
+    AliasTable table{zipf, 0.75};
+    Random random{1};
+    vector<uint64_t> bits(Sampler::block);
+    long long n = 0;
+    for (; n < 5000000; n += bits.size()) {
+        random.fill(bits.data(), bits.size());
+        for (uint64_t b : bits) counts[min(table.draw(b) + 1, (int)zipf.size() - 1)]++;
+    }
+    auto [statistic, freedom] = chi_square(counts, expected(zipf, 0.75), n);
+    CHECK(statistic > freedom + 6 * sqrt(2.0 * freedom));
+    return test_result();
+}
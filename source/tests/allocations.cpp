@@ -0,0 +1,90 @@
+#include <new>
+#include <atomic>
+#include <cstdlib>
+#include <string>
+#include <fstream>
+#include <filesystem>
+#include <functional>
+#include <unistd.h>
+#include "check.hpp"
+#include "options.hpp"
+#define WORD2VEC_NO_MAIN
+#include "../word2vec.cpp"
+
+// The training loop of word2vec makes no heap allocation per word: the allocations counted
+// through operator new are the same whether learn trains on one pass of the text or on four.
+
+std::atomic<long long> allocations = 0;
+
+void* allocate(std::size_t n, std::size_t alignment = 0) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = alignment ? std::aligned_alloc(alignment, (n + alignment - 1) / alignment * alignment) : std::malloc(n);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(std::size_t n) { return allocate(n); }
+void* operator new[](std::size_t n) { return allocate(n); }
+void* operator new(std::size_t n, std::align_val_t a) { return allocate(n, (std::size_t)a); }
+void* operator new[](std::size_t n, std::align_val_t a) { return allocate(n, (std::size_t)a); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+// Allocations made by learn over `iterations` passes of the text, in one chunk per pass
+long long learn_allocations(WordEmbedding& res, int iterations, int negative) {
+    const Text& text = res.text;
+    Scheduler scheduler{text.size(), text.size(), iterations, 1};
+    WorkerStats stats;
+    // One entry per chunk, not per word
+    stats.chunk_seconds.reserve(iterations);
+    res.start_workers(1, 1);
+    auto start = std::chrono::steady_clock::now();
+    long long before = allocations.load();
+    res.learn(scheduler, 0, 0.025f, 5, negative, iterations, 1 << 14, start, stats);
+    return allocations.load() - before;
+}
+
+void check_learn(const Text& text, const std::string& name, int negative,
+                 const std::function<void(WordEmbedding&)>& setup) {
+    WordEmbedding res{50, text};
+    setup(res);
+    // The first pass makes the thread_local scratch rows
+    learn_allocations(res, 1, negative);
+    long long one = learn_allocations(res, 1, negative);
+    long long four = learn_allocations(res, 4, negative);
+    if (one != four) std::cerr << name << ": " << one << " allocations for one pass, " << four << " for four\n";
+    CHECK(one == four);
+}
+
+int main() {
+    using namespace std;
+    namespace fs = std::filesystem;
+    fs::path dir = fs::temp_directory_path() / ("word2vec_test_allocations_" + to_string(getpid()));
+    fs::create_directories(dir);
+    {
+        ofstream os{dir / "text.txt"};
+        uint64_t x = 1;
+        for (int i = 0; i < 100000; i++) {
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+            // Zipf-like: the low ids are the most frequent
+            os << "w" << (x >> 33) % ((x >> 23) % 1000 + 1) << (i % 20 == 19 ? '\n' : ' ');
+        }
+    }
+    Text text{options(dir / "text.txt", 1, false, 1e-3f)};
+    // Joins the encoding threads, so that only the training allocates
+    text.wait(0, text.size());
+    text.encoder.reset();
+    check_learn(text, "negative sampling", 5, [](WordEmbedding&) {});
+    check_learn(text, "batches", 5, [](WordEmbedding& res) { res.batch = 4; });
+    check_learn(text, "hierarchical softmax", 0, [](WordEmbedding& res) { res.use_hierarchical_softmax(); });
+    check_learn(text, "hogwild", 5, [](WordEmbedding& res) { res.hogwild = true; });
+    check_learn(text, "bf16", 5, [](WordEmbedding& res) { res.set_precision(Precision::bf16, Precision::bf16, true); });
+    fs::remove_all(dir);
+    return test_result();
+}
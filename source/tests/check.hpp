@@ -0,0 +1,21 @@
+#pragma once
+
+#include <iostream>
+#include <cstdlib>
+
+// Checks of the tests: a failed check is printed with its line, and the test goes on so that
+// all the failures are seen. main returns test_result().
+inline int failed_checks = 0;
+
+#define CHECK(condition)                                                                       \
+    do {                                                                                       \
+        if (!(condition)) {                                                                    \
+            std::cerr << __FILE__ << ':' << __LINE__ << ": check failed: " #condition << '\n'; \
+            failed_checks++;                                                                   \
+        }                                                                                      \
+    } while (false)
+
+inline int test_result() {
+    if (failed_checks) std::cerr << failed_checks << " checks failed\n";
+    return failed_checks ? EXIT_FAILURE : EXIT_SUCCESS;
+}
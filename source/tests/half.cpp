@@ -0,0 +1,92 @@
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include "check.hpp"
+#include "../half.hpp"
+
+// The vector conversions to 16 bits round as the scalar ones: to nearest even the same bits,
+// stochastically to one of the two neighbours, up with the probability that keeps the mean.
+
+// Floats of every exponent and sign, NaNs, infinities and subnormals included
+std::vector<float> samples() {
+    std::vector<float> res;
+    for (uint64_t bits = 0; bits < (1ULL << 32); bits += 0x1003) res.emplace_back(std::bit_cast<float>((uint32_t)bits));
+    for (uint32_t bits : {0x00000000u, 0x80000000u, 0x7f800000u, 0xff800000u, 0x7fc00000u, 0x477fefffu, 0x477ff000u,
+                          0x38800000u, 0x387fffffu, 0x33000000u, 0x33000001u}) {
+        res.emplace_back(std::bit_cast<float>(bits));
+    }
+    return res;
+}
+
+bool same_bits(const std::vector<uint16_t>& x, const std::vector<uint16_t>& y) {
+    return x.size() == y.size() && std::memcmp(x.data(), y.data(), x.size() * sizeof(uint16_t)) == 0;
+}
+
+// The mean of many stochastic roundings of x is x, each being a neighbour of x
+void check_stochastic(void (*convert)(const float*, uint16_t*, int, bool), float (*to_float)(uint16_t), float x) {
+    constexpr int n = 1 << 16;
+    std::vector<float> in(n, x);
+    std::vector<uint16_t> out(n);
+    convert(in.data(), out.data(), n, true);
+    uint16_t low = out[0], high = out[0];
+    double sum = 0;
+    for (uint16_t h : out) {
+        if (to_float(h) < to_float(low)) low = h;
+        if (to_float(h) > to_float(high)) high = h;
+        sum += to_float(h);
+    }
+    // Two consecutive values, or x itself
+    CHECK(to_float(low) <= x && x <= to_float(high));
+    CHECK(high == low || std::abs(high - low) == 1);
+    // 6 standard deviations of the mean of n coins
+    CHECK(std::abs(sum / n - x) <= 6 * (to_float(high) - to_float(low)) / 2 / std::sqrt((double)n) + 1e-12);
+}
+
+int main() {
+    using namespace std;
+#if defined(__x86_64__) || defined(__i386__)
+    if (!half::has_avx2()) {
+        cout << "no AVX2, nothing to test" << endl;
+        return test_result();
+    }
+    vector<float> in = samples();
+    int n = in.size();
+    vector<uint16_t> vector_out(n), scalar_out(n);
+    half::float_to_bf16_avx2(in.data(), vector_out.data(), n, false);
+    for (int i = 0; i < n; i++) scalar_out[i] = half::float_to_bf16(in[i]);
+    CHECK(same_bits(vector_out, scalar_out));
+    half::float_to_fp16_avx2(in.data(), vector_out.data(), n, false);
+    for (int i = 0; i < n; i++) scalar_out[i] = half::float_to_fp16(in[i]);
+    CHECK(same_bits(vector_out, scalar_out));
+    // Ties and the values next to them, one of each in every vector
+    for (float x : {1.0f + 0x1p-11f, 1.0f + 0x1p-11f + 0x1p-23f, 1.0f + 3 * 0x1p-11f, 1.0f + 0x1p-8f, 3.0f + 0x1p-7f}) {
+        vector<float> v(16, x);
+        vector<uint16_t> h(16), b(16);
+        half::float_to_fp16_avx2(v.data(), h.data(), 16, false);
+        half::float_to_bf16_avx2(v.data(), b.data(), 16, false);
+        CHECK(h[0] == half::float_to_fp16(x) && h[15] == half::float_to_fp16(x));
+        CHECK(b[0] == half::float_to_bf16(x) && b[15] == half::float_to_bf16(x));
+    }
+    for (float x : {1.0f + 0x1p-12f, -3.14159f, 1e-3f, 65000.0f, 1.0f / 3}) {
+        check_stochastic(half::float_to_fp16_avx2, half::fp16_to_float, x);
+        check_stochastic(half::float_to_bf16_avx2, half::bf16_to_float, x);
+    }
+    // Below the smallest normal fp16 and beyond the largest, where the noise changes nothing
+    vector<float> edges{1e-6f, -1e-6f, 70000.0f, -1e10f, INFINITY, NAN, 6e-8f, -1e5f};
+    vector<uint16_t> h(edges.size());
+    half::float_to_fp16_avx2(edges.data(), h.data(), edges.size(), true);
+    for (size_t i = 0; i < edges.size(); i++) CHECK(h[i] == half::float_to_fp16(edges[i]));
+    // A row through HalfMatrix
+    Matrix<float> m(2, 37);
+    for (int i = 0; i < 2 * 37; i++) m[i / 37][i % 37] = sin(i + 1.0f);
+    for (Precision p : {Precision::bf16, Precision::fp16}) {
+        HalfMatrix half(m, p, true);
+        Matrix<float> back = half.to_float();
+        bool close = true;
+        for (int i = 0; i < 2 * 37; i++) close &= abs(back[i / 37][i % 37] - m[i / 37][i % 37]) <= 1e-2f;
+        CHECK(close);
+    }
+#endif
+    return test_result();
+}
@@ -0,0 +1,23 @@
+#include <vector>
+#include <iostream>
+#include "check.hpp"
+#include "../kernels.hpp"
+
+int main() {
+    // Every version the processor supports agrees with the scalar one
+    std::vector<Kernels> versions = Kernels::supported();
+    CHECK(versions.front().name == std::string("scalar"));
+    CHECK(Kernels::get().name == versions.back().name);
+    for (const Kernels& k : versions) {
+        double difference = k.check();
+        std::cout << k.name << ": " << difference << std::endl;
+        CHECK(difference < Kernels::tolerance);
+    }
+    // The relaxed kernels of --hogwild too
+    CHECK(Kernels::relaxed().check() < Kernels::tolerance);
+    // A kernel that skips the last element is caught
+    Kernels broken = Kernels::scalar();
+    broken.dot = [](const float* x, const float* y, int n) { return kernels::scalar::dot(x, y, n - (n > 0)); };
+    CHECK(broken.check() > Kernels::tolerance);
+    return test_result();
+}
@@ -0,0 +1,98 @@
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include "check.hpp"
+#include "../scheduler.hpp"
+
+// The scheduling of both trainers on texts of more than 2^31 words, without the words: the
+// positions, chunks, slices and learning rates are computed as for a real text of that size.
+
+// All the items of a scheduler, half of the threads stealing once their own range is done,
+// cover each chunk once per pass, within the text
+void check_scheduler(long long text_size, long long chunk, int iterations, int nb_threads) {
+    Scheduler scheduler{text_size, chunk, iterations, nb_threads};
+    long long nb_chunks = (text_size + scheduler.chunk - 1) / scheduler.chunk;
+    std::vector<uint8_t> seen(nb_chunks * iterations);
+    long long words = 0, items = 0;
+    bool in_bounds = true, aligned = true;
+    for (int t = 0; t < nb_threads; t++) {
+        while (std::optional<Scheduler::Item> item = t % 2 ? scheduler.steal(t) : scheduler.pop(t)) {
+            in_bounds &= item->iteration >= 0 && item->iteration < iterations && 0 <= item->begin &&
+                         item->begin < item->end && item->end <= text_size;
+            if (!in_bounds) break;
+            aligned &= item->begin % scheduler.chunk == 0 &&
+                       (item->end - item->begin == scheduler.chunk || item->end == text_size);
+            seen[item->iteration * nb_chunks + item->begin / scheduler.chunk]++;
+            words += item->end - item->begin;
+            items++;
+        }
+    }
+    for (int t = 0; t < nb_threads; t++) {
+        while (std::optional<Scheduler::Item> item = scheduler.pop(t)) {
+            seen[item->iteration * nb_chunks + item->begin / scheduler.chunk]++;
+            words += item->end - item->begin;
+            items++;
+        }
+    }
+    CHECK(in_bounds);
+    CHECK(aligned);
+    CHECK(items == nb_chunks * iterations);
+    CHECK(words == iterations * text_size);
+    CHECK(std::all_of(seen.begin(), seen.end(), [](uint8_t n) { return n == 1; }));
+}
+
+int main() {
+    using namespace std;
+    long long big = 5000000000LL;
+    check_scheduler(big, 1 << 16, 3, 7);
+    check_scheduler((1LL << 31) + 12345, 1 << 20, 2, 4);
+    // Chunks of one word would need more than 2^32 items per thread: they are made bigger
+    {
+        Scheduler scheduler{1LL << 40, 1, 5, 3};
+        CHECK(scheduler.chunk > 1);
+        for (const Scheduler::Queue& q : scheduler.queues) CHECK(q.nb_chunks * 5 < (1LL << 32));
+        const Scheduler::Queue& last = scheduler.queues.back();
+        Scheduler::Item item = scheduler.item(last, last.nb_chunks * 5 - 1);
+        CHECK(item.iteration == 4);
+        CHECK(item.end == 1LL << 40);
+        CHECK(scheduler.item(scheduler.queues[0], 0).begin == 0);
+    }
+    // The learning rate goes down with the words read over all the passes, not with a count
+    // that wraps at 2^31
+    {
+        long long total = 3 * big;
+        float alpha = 0.025f;
+        CHECK(learning_rate(alpha, 0, total) == alpha);
+        CHECK(abs(learning_rate(alpha, total / 2, total) - alpha / 2) < 1e-6f);
+        CHECK(abs(learning_rate(alpha, (1LL << 31) + 1, total) - alpha * (1 - ((1LL << 31) + 1.0) / total)) < 1e-7f);
+        CHECK(learning_rate(alpha, total, total) == alpha * 1e-4f);
+        float last = alpha;
+        bool decreasing = true;
+        for (long long read = 0; read <= total; read += total / 1000) {
+            float a = learning_rate(alpha, read, total);
+            decreasing &= a <= last && a > 0;
+            last = a;
+        }
+        CHECK(decreasing);
+    }
+    // Slices of word2vec2: the processes together cover the text once
+    for (long long slice : {1LL << 20, (big + 63) / 64, big}) {
+        for (int world : {1, 3}) {
+            long long words = 0, count = 0;
+            bool in_bounds = true;
+            for (int rank = 0; rank < world; rank++) {
+                for (auto [begin, end] : make_slices(big, slice, world, rank)) {
+                    in_bounds &= 0 <= begin && begin < end && end <= big && end - begin <= slice;
+                    words += end - begin;
+                    count++;
+                }
+            }
+            CHECK(in_bounds);
+            CHECK(words == big);
+            CHECK(count == (big + slice - 1) / slice);
+        }
+    }
+    CHECK(make_slices(0, 0, 1, 0).empty());
+    return test_result();
+}
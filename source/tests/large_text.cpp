@@ -0,0 +1,152 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include "check.hpp"
+#include "options.hpp"
+#include "../text.hpp"
+#include "../token_reader.hpp"
+#include "../sliding_window.hpp"
+#include "../scheduler.hpp"
+
+namespace fs = std::filesystem;
+
+// A corpus cache of more than 2^31 ids, read back streamed and mapped. The file is sparse: the
+// ids are 0 except around a few positions past 2^31, where the id of position p is id(p).
+
+constexpr long long text_size = 3LL << 30;
+constexpr int marked = 64;
+const std::vector<long long> positions{(1LL << 31) - marked / 2, (1LL << 31) + 1000003, text_size - marked};
+
+int vocabulary_size = 0;
+
+int id(long long p) {
+    return 1 + p % (vocabulary_size - 1);
+}
+
+// Ids read at position begin: id(p) in the marked ranges, 0 elsewhere
+bool same_ids(std::span<const int> ids, long long begin) {
+    for (long long i = 0; i < (long long)ids.size(); i++) {
+        long long p = begin + i;
+        bool in_range = std::any_of(positions.begin(), positions.end(), [&](long long q) { return q <= p && p < q + marked; });
+        if (ids[i] != (in_range ? id(p) : 0)) return false;
+    }
+    return true;
+}
+
+// Writes the cache of the vocabulary of the training file, with text_size ids
+bool write_cache(const po::variables_map& vm, const std::string& cache) {
+    using namespace std;
+    Text text{vm};
+    text.wait(0, text.size());
+    text.text.clear();
+    text.stream = cache;
+    text.stream_size = text_size;
+    vocabulary_size = text.vocabulary.size();
+    {
+        ofstream os{cache, ios::binary};
+        text.save_cache(os, Text::CacheKey{vm});
+        if (!os) return false;
+    }
+    long long offset = fs::file_size(cache);
+    FileDescriptor file{open(cache.c_str(), O_WRONLY)};
+    if (ftruncate(file.fd, offset + text_size * sizeof(int)) != 0) return false;
+    for (long long p : positions) {
+        vector<int> ids(marked);
+        for (int i = 0; i < marked; i++) ids[i] = id(p + i);
+        if (pwrite(file.fd, ids.data(), marked * sizeof(int), offset + p * sizeof(int)) != marked * (ssize_t)sizeof(int)) return false;
+    }
+    return true;
+}
+
+void check_text(const Text& text) {
+    CHECK(text.size() == text_size);
+    CHECK(text.vocabulary.size() == vocabulary_size);
+    // Blocks across the marked ranges, the first one across 2^31
+    TokenReader reader{text, 1 << 12};
+    for (long long p : positions) {
+        long long begin = p - 100, end = std::min(text_size, p + marked + 100);
+        std::span<const int> ids = reader.read(begin, end);
+        CHECK((long long)ids.size() == end - begin && same_ids(ids, begin));
+    }
+    std::span<const int> last = reader.read(text_size - 10, text_size);
+    CHECK(last.size() == 10 && same_ids(last, text_size - 10));
+    // The slices of word2vec2 and the chunks of word2vec holding the marked positions start
+    // where they should and give the ids of their positions
+    long long slice = (1 << 16) + 3;
+    int world = 3;
+    for (long long p : positions) {
+        long long index = p / slice;
+        auto slices = make_slices(text_size, slice, world, index % world);
+        auto [begin, end] = slices[index / world];
+        CHECK(begin == index * slice && begin <= p && p < end);
+        std::span<const int> ids = reader.read(begin, end);
+        CHECK((long long)ids.size() == end - begin && same_ids(ids, begin));
+    }
+    Scheduler scheduler{text_size, 1 << 16, 1, 4};
+    for (long long p : positions) {
+        for (const Scheduler::Queue& q : scheduler.queues) {
+            for (long long k = 0; k < q.nb_chunks; k++) {
+                Scheduler::Item item = scheduler.item(q, k);
+                if (item.begin > p || p >= item.end) continue;
+                CHECK(item.begin % scheduler.chunk == 0);
+                std::span<const int> ids = reader.read(item.begin, item.end);
+                CHECK((long long)ids.size() == item.end - item.begin && same_ids(ids, item.begin));
+            }
+        }
+    }
+}
+
+// The sliding window of a block of more than 2^31 ids, at positions past 2^31: as if all the
+// words before had been kept
+void check_window(const Text& text) {
+    std::span<const int> block = text.ids();
+    CHECK((long long)block.size() == text_size);
+    int window = 5;
+    SlidingWindow words;
+    words.reserve(2 * window + 1);
+    words.start(block);
+    Sampler sampler;
+    for (long long p : positions) {
+        long long start = p + marked / 2 + window;
+        words.read = words.end = start;
+        CHECK(words.fill(start + window, sampler, {}) == std::min(text_size, start + window + 1));
+        bool same = true;
+        for (long long j = start; j < words.end; j++) same &= words[j] == id(j);
+        CHECK(same);
+    }
+}
+
+int main() {
+    using namespace std;
+    fs::path dir = fs::temp_directory_path() / ("word2vec_test_large_text_" + to_string(getpid()));
+    fs::create_directories(dir);
+    {
+        ofstream os{dir / "train.txt"};
+        for (int i = 0; i < 1000; i++) os << "w" << i % 37 << (i % 10 == 9 ? '\n' : ' ');
+    }
+    string cache = dir / "cache";
+    po::variables_map vm = options(dir / "train.txt", 2, false);
+    if (!write_cache(vm, cache)) {
+        cout << "no sparse file of " << text_size * sizeof(int) << " bytes in " << dir << ", nothing to test" << endl;
+        fs::remove_all(dir);
+        return test_result();
+    }
+    vm.insert({"corpus-cache", po::variable_value(cache, false)});
+    {
+        Text text{vm};
+        CHECK(text.cache_file != nullptr);
+        check_text(text);
+        check_window(text);
+    }
+    vm.insert({"stream", po::variable_value()});
+    {
+        Text text{vm};
+        CHECK(text.stream == cache);
+        check_text(text);
+    }
+    fs::remove_all(dir);
+    return test_result();
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+#include <boost/program_options.hpp>
+
+// Options of the trainers read by Text
+inline boost::program_options::variables_map options(const std::string& train, int threads, bool stop,
+                                                     float sample = 0) {
+    namespace po = boost::program_options;
+    po::variables_map vm;
+    vm.insert({"train", po::variable_value(train, false)});
+    vm.insert({"min-count", po::variable_value(1, false)});
+    vm.insert({"thread", po::variable_value(threads, false)});
+    vm.insert({"sample", po::variable_value(sample, false)});
+    if (stop) vm.insert({"stop", po::variable_value()});
+    return vm;
+}
@@ -0,0 +1,60 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <cstdlib>
+#include <unistd.h>
+#include "check.hpp"
+
+// The trainers given as arguments (word2vec, then word2vec2) give the same model twice with
+// the same seed: word2vec with one thread, word2vec2 with several, with or without staleness.
+
+namespace fs = std::filesystem;
+
+std::string content(const fs::path& filename) {
+    std::ifstream is{filename, std::ios::binary};
+    std::ostringstream os;
+    os << is.rdbuf();
+    return os.str();
+}
+
+// Trains twice and compares the models
+void check_same(const std::string& trainer, const fs::path& dir, const std::string& options) {
+    std::vector<std::string> models;
+    for (int run = 0; run < 2; run++) {
+        fs::path model = dir / ("model" + std::to_string(run) + ".bin");
+        std::string command = trainer + " --train " + (dir / "text.txt").string() + " --output " + model.string() +
+                              " --seed 7 --min-count 1 --size 20 --iter 2 " + options + " > /dev/null 2>&1";
+        CHECK(std::system(command.c_str()) == 0);
+        models.emplace_back(content(model));
+    }
+    CHECK(!models[0].empty());
+    if (models[0] != models[1]) std::cerr << trainer << ' ' << options << ": the models differ\n";
+    CHECK(models[0] == models[1]);
+}
+
+int main(int argc, char* argv[]) {
+    using namespace std;
+    if (argc < 3) {
+        cerr << "usage: test_reproducible WORD2VEC WORD2VEC2\n";
+        return EXIT_FAILURE;
+    }
+    fs::path dir = fs::temp_directory_path() / ("word2vec_test_reproducible_" + to_string(getpid()));
+    fs::create_directories(dir);
+    {
+        ofstream os{dir / "text.txt"};
+        uint64_t x = 1;
+        for (int i = 0; i < 200000; i++) {
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+            os << "w" << (x >> 33) % ((x >> 23) % 500 + 1) << (i % 20 == 19 ? '\n' : ' ');
+        }
+    }
+    check_same(argv[1], dir, "--thread 1");
+    check_same(argv[1], dir, "--thread 1 --hs");
+    check_same(argv[2], dir, "--thread 3 --work 5000");
+    check_same(argv[2], dir, "--thread 3 --work 5000 --staleness 2");
+    check_same(argv[2], dir, "--thread 3 --work 5000 --staleness 1 --hs");
+    fs::remove_all(dir);
+    return test_result();
+}
@@ -0,0 +1,75 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <unistd.h>
+#include "check.hpp"
+#include "options.hpp"
+#include "../text.hpp"
+
+namespace fs = std::filesystem;
+
+// The ids of the text are those of its words in the vocabulary, all of them written
+void check_ids(const Text& text, const std::vector<std::string>& words) {
+    CHECK(text.size() == (long long)words.size());
+    text.wait(0, text.size());
+    std::span<const int> ids = text.ids();
+    for (long long i = 0; i < std::min(text.size(), (long long)words.size()); i++) {
+        CHECK(ids[i] >= 0 && ids[i] < text.vocabulary.size());
+        CHECK(text.vocabulary.find(words[i]) == ids[i]);
+    }
+}
+
+int main() {
+    using namespace std;
+    fs::path dir = fs::temp_directory_path() / ("word2vec_test_text_" + to_string(getpid()));
+    fs::create_directories(dir);
+    // A base trained without --stop has stop words in its vocabulary. With --stop, the new text
+    // leaves them out of the ids as it leaves them out of the counts.
+    {
+        ofstream os{dir / "new.txt"};
+        for (int i = 0; i < 20000; i++) os << "the cat " << (i % 3 ? "sat on" : "ran to") << " a mat\n";
+    }
+    // Words of the ids, in the order of the text
+    vector<string> words;
+    for (int i = 0; i < 20000; i++) {
+        for (string w : {"cat", i % 3 ? "sat" : "ran", "mat"}) words.emplace_back(w);
+    }
+    for (int threads : {1, 3, 8}) {
+        Text base;
+        for (string_view w : {"the", "cat", "on", "a", "dog"}) {
+            base.vocabulary.insert(w);
+            base.cnt.emplace_back(10);
+        }
+        Text text{options(dir / "new.txt", threads, true), &base};
+        check_ids(text, words);
+        CHECK(text.vocabulary.find("the") == 0);
+        CHECK(text.cnt[0] == 10);
+        CHECK(text.cnt[text.vocabulary.find("cat")] == 10 + 20000);
+    }
+    // Without --stop, the stop words are in the ids
+    vector<string> all;
+    for (int i = 0; i < 20000; i++) {
+        for (string w : {"the", "cat", i % 3 ? "sat" : "ran", i % 3 ? "on" : "to", "a", "mat"}) all.emplace_back(w);
+    }
+    Text text{options(dir / "new.txt", 4, false)};
+    check_ids(text, all);
+    // A cache whose last id is out of the vocabulary is not used, the text is read again
+    {
+        po::variables_map vm = options(dir / "new.txt", 2, false);
+        string cache = dir / "cache";
+        vm.insert({"corpus-cache", po::variable_value(cache, false)});
+        { Text written{vm}; }
+        {
+            fstream fs{cache, ios::in | ios::out | ios::binary};
+            fs.seekp(-(int)sizeof(int), ios::end);
+            int id = text.vocabulary.size();
+            fs.write(reinterpret_cast<const char*>(&id), sizeof(id));
+        }
+        Text cached{vm};
+        CHECK(!cached.cache_file);
+        check_ids(cached, all);
+    }
+    fs::remove_all(dir);
+    return test_result();
+}
@@ -1,101 +1,554 @@
 #pragma once
 #include <boost/program_options.hpp>
+#include <string_view>
+#include <thread>
+#include <fstream>
+#include <filesystem>
+#include <optional>
+#include <numeric>
+#include <algorithm>
+#include <execution>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <bit>
+#include <sys/stat.h>
+#include "util.hpp"
 #include "debug.hpp"
+#include "mapped_file.hpp"
+#include "alias.hpp"
+#include "vocabulary.hpp"
 
 namespace po = boost::program_options;
 
 struct Text {
-    inline static const std::set<std::string> stopwords {"unto", "le", "de", "la", "s", "still","should","very","for","quite","moreover","less","thereafter","thereupon","never","a","except","i","around","that","three","ourselves","as","had","over","six","almost","am","ours","others","latter","could","through","were","is","name","'ll","'re","where","then","least","can","call","us","last","was","behind","further","using","below","his","thence","your","whole","ca","did","wherein","give","yours","into","does","upon","nor","seeming","one","done","thus","hundred","not","empty","herself","four","yourselves","please","when","against","top","other","some","once","really","just","we","though","doing","own","off","our","onto","together","whether","he","since","else","even","see","the","beyond","serious","these","wherever","its","made","itself","has","mostly","seemed","alone","becoming","besides","side","beforehand","forty","neither","twenty","would","up","in","than","elsewhere","mine","sometime","front","regarding","yet","via","been","seems","my","therein","eight","nine","whatever","after","she","among","of","unless","who","such","beside","and","within","or","show","toward","any","all","either","ever","everywhere","if","while","sometimes","whenever","no","whereas","anyhow","hence","go","from","so","used","much","back","whose","although","five","everyone","re","whither","fifty","various","'m","by","anyone","many","whereby","with","those","why","always","few","will","another","rather","n't","during","here","fifteen","without","otherwise","anywhere","hereafter","nevertheless","out","whoever","be","hereby","also","again","thru","across","himself","both","noone","until","too","whereafter","along","myself","they","somewhere","therefore","none","per","on","afterwards","someone","their","are","nobody","move","towards","whom","enough","more","became","'s","you","sixty","them","becomes","about","hereupon","become","same","hers","meanwhile","due","being","amount","down","perhaps","have","yourself","themselves","which","to","well","namely","make","often","there","me","cannot","this","first","at","twelve","what","indeed","eleven","an","above","former","part","'d","put","full","nowhere","how","because","ten","latterly","third","under","before","get","next","seem","anyway","must","take","might","throughout","however","something","amongst","bottom","'ve","every","formerly","already","between","keep","may","somehow","two","whereupon","anything","say","several","but","do","each","him","herein","everything","it","most","only","thereby","whence","nothing","now","her",};
-    std::vector<int> text;
-    std::vector<std::string> vocabulary;
-    std::vector<int> cnt;
-    std::vector<int> unigram_table;
+    inline static const Vocabulary stopwords {"unto", "le", "de", "la", "s", "still","should","very","for","quite","moreover","less","thereafter","thereupon","never","a","except","i","around","that","three","ourselves","as","had","over","six","almost","am","ours","others","latter","could","through","were","is","name","'ll","'re","where","then","least","can","call","us","last","was","behind","further","using","below","his","thence","your","whole","ca","did","wherein","give","yours","into","does","upon","nor","seeming","one","done","thus","hundred","not","empty","herself","four","yourselves","please","when","against","top","other","some","once","really","just","we","though","doing","own","off","our","onto","together","whether","he","since","else","even","see","the","beyond","serious","these","wherever","its","made","itself","has","mostly","seemed","alone","becoming","besides","side","beforehand","forty","neither","twenty","would","up","in","than","elsewhere","mine","sometime","front","regarding","yet","via","been","seems","my","therein","eight","nine","whatever","after","she","among","of","unless","who","such","beside","and","within","or","show","toward","any","all","either","ever","everywhere","if","while","sometimes","whenever","no","whereas","anyhow","hence","go","from","so","used","much","back","whose","although","five","everyone","re","whither","fifty","various","'m","by","anyone","many","whereby","with","those","why","always","few","will","another","rather","n't","during","here","fifteen","without","otherwise","anywhere","hereafter","nevertheless","out","whoever","be","hereby","also","again","thru","across","himself","both","noone","until","too","whereafter","along","myself","they","somewhere","therefore","none","per","on","afterwards","someone","their","are","nobody","move","towards","whom","enough","more","became","'s","you","sixty","them","becomes","about","hereupon","become","same","hers","meanwhile","due","being","amount","down","perhaps","have","yourself","themselves","which","to","well","namely","make","often","there","me","cannot","this","first","at","twelve","what","indeed","eleven","an","above","former","part","'d","put","full","nowhere","how","because","ten","latterly","third","under","before","get","next","seem","anyway","must","take","might","throughout","however","something","amongst","bottom","'ve","every","formerly","already","between","keep","may","somehow","two","whereupon","anything","say","several","but","do","each","him","herein","everything","it","most","only","thereby","whence","nothing","now","her",};
+    // Ids of the words, positions and counts are 64 bits but the ids are 32 bits. Left
+    // uninitialized when allocated: the encoder threads write them, each its own range.
+    std::vector<int, default_init_allocator<int>> text;
+    // Ids loaded from the corpus cache, left in its mapping instead of text (see ids)
+    std::unique_ptr<MappedFile> cache_file;
+    std::span<const int> mapped;
+    Vocabulary vocabulary;
+    std::vector<long long> cnt;
+    AliasTable unigram;
     std::vector<float> subsampling;
+    // With --stream, the ids are not in text but in the corpus cache `stream`, at byte `stream_offset`.
+    // The cache is opened once, so that the ids stay those of this text if the file is replaced.
+    std::string stream;
+    FileDescriptor stream_file;
+    long long stream_offset = 0;
+    long long stream_size = 0;
 
-    Text(const po::variables_map& vm) {
+    // Ids of the text being written in the background by read: chunk t of the file writes its ids
+    // to text[offsets[t]] onwards and publishes in encoded[t] how many are written, so that the
+    // training can start on the first ids of each chunk. The threads only use heap memory and
+    // the vocabulary, which must not move until they are done.
+    struct Encoder {
+        MappedFile file;
+        std::vector<std::string_view> chunks;
+        std::vector<long long> offsets;
+        std::unique_ptr<std::atomic<long long>[]> encoded;
+        std::vector<std::chrono::steady_clock::time_point> finished;
+        std::vector<std::thread> threads;
+        bool use_stop_words = false;
+
+        explicit Encoder(const std::string& filename) : file(filename) {}
+
+        ~Encoder() {
+            for (auto& thread : threads) thread.join();
+        }
+
+        // Id of w in the text, -1 if it is left out. The filter must be the one of the counts, which
+        // give the offsets: a stop word may be in the vocabulary of a base trained without --stop.
+        int id(const Vocabulary& vocabulary, std::string_view w) const {
+            if (use_stop_words && stopwords.contains(w)) return -1;
+            return vocabulary.find(w);
+        }
+
+        void start(const Vocabulary& vocabulary, int* text) {
+            int nb_chunks = chunks.size();
+            encoded = std::make_unique<std::atomic<long long>[]>(nb_chunks);
+            finished.resize(nb_chunks);
+            for (int t = 0; t < nb_chunks; t++) {
+                threads.emplace_back([this, t, &vocabulary, ids = text + offsets[t]] {
+                    // Published by blocks, a store per id would slow the encoding down
+                    constexpr long long publish = 1 << 14;
+                    long long n = 0;
+                    for_each_word(chunks[t], [&](std::string_view w) {
+                        int id = this->id(vocabulary, w);
+                        if (id == -1) return;
+                        ids[n++] = id;
+                        if (n % publish == 0) {
+                            encoded[t].store(n, std::memory_order_release);
+                            encoded[t].notify_all();
+                        }
+                    });
+                    finished[t] = std::chrono::steady_clock::now();
+                    encoded[t].store(n, std::memory_order_release);
+                    encoded[t].notify_all();
+                });
+            }
+        }
+
+        void wait(long long begin, long long end) const {
+            for (size_t t = 0; t + 1 < offsets.size(); t++) {
+                if (offsets[t + 1] <= begin || offsets[t] >= end) continue;
+                long long needed = std::min(end, offsets[t + 1]) - offsets[t];
+                for (long long n; (n = encoded[t].load(std::memory_order_acquire)) < needed;) encoded[t].wait(n);
+            }
+        }
+    };
+    // Declared last, so that its threads are joined before the text is destroyed
+    std::unique_ptr<Encoder> encoder;
+
+    // Ids of the text when it is in memory
+    std::span<const int> ids() const {
+        return cache_file ? mapped : std::span<const int>(text);
+    }
+
+    long long size() const {
+        return stream.empty() ? (long long)ids().size() : stream_size;
+    }
+
+    // Waits until the ids in [begin, end) are in text
+    void wait(long long begin, long long end) const {
+        if (encoder) encoder->wait(begin, end);
+    }
+
+    // Waits for all the ids, and returns when the last ones were written
+    std::chrono::steady_clock::time_point encoded() const {
+        if (!encoder) return {};
+        wait(0, size());
+        return *std::max_element(encoder->finished.begin(), encoder->finished.end());
+    }
+
+    static bool is_space(char c) {
+        return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    // Calls f on each word of s, words are separated by white spaces as with operator>>
+    template<typename F>
+    static void for_each_word(std::string_view s, F f) {
+        const char* p = s.data();
+        const char* end = p + s.size();
+        while (true) {
+            while (p != end && is_space(*p)) p++;
+            if (p == end) return;
+            const char* q = p;
+            while (q != end && !is_space(*q)) q++;
+            f(std::string_view(p, q - p));
+            p = q;
+        }
+    }
+
+    // Splits s in n parts ending on a white space, so that no word is cut
+    static std::vector<std::string_view> split(std::string_view s, int n) {
+        std::vector<std::string_view> res;
+        size_t start = 0;
+        for (int i = 1; i <= n; i++) {
+            size_t end = i == n ? s.size() : std::max(start, s.size() / n * i);
+            while (end < s.size() && !is_space(s[end])) end++;
+            res.emplace_back(s.substr(start, end - start));
+            start = end;
+        }
+        return res;
+    }
+
+    template<typename F>
+    static void parallel_for(int n, F f) {
+        std::vector<std::thread> workers;
+        for (int i = 0; i < n; i++) {
+            workers.emplace_back(f, i);
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // Everything needed to know if a corpus cache was built from the same training file with the same options
+    struct CacheKey {
+        std::string train;
+        long long file_size;
+        long long modification_time;
+        int min_count;
+        int stop;
+        float sample;
+
+        CacheKey(const po::variables_map& vm) {
+            train = std::filesystem::weakly_canonical(vm["train"].as<std::string>());
+            struct stat st;
+            if (stat(train.c_str(), &st) == 0) {
+                file_size = st.st_size;
+                modification_time = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+            } else {
+                file_size = modification_time = -1;
+            }
+            min_count = vm["min-count"].as<int>();
+            stop = vm.count("stop");
+            sample = vm["sample"].as<float>();
+        }
+
+        bool operator==(const CacheKey&) const = default;
+    };
+
+    // Fills vocabulary, cnt, the sampling distributions and the ids from the training file.
+    // The ids are written to text by the encoder, in the background: see wait.
+    // When streaming, the ids are written directly to the corpus cache instead of text.
+    // With a base, the words of the base keep their ids whatever their count, the new words
+    // are added after them (by decreasing count), and the counts of the base are added to the counts of the text.
+    bool read(const po::variables_map& vm, const std::string& cache, const std::optional<CacheKey>& key,
+              const Text* base) {
         using namespace std;
         {
-            // text, vocabulary, cnt
-            vector<pair<string, int>> words;
             string filename = vm["train"].as<string>();
-            ifstream is{filename, ios::binary};
-            if (!is.is_open()) {
+            auto encoder = make_unique<Encoder>(filename);
+            const MappedFile& file = encoder->file;
+            if (!file.is_open()) {
                 error("error while opening text " + filename);
-                return;
-            }
-            bool use_stop_words = vm.count("stop");
-            for (int i = 0; !(is.eof() || is.bad());) {
-                string w;
-                is >> w;
-                if (w == "" || (use_stop_words && stopwords.count(w))) continue;
-                words.emplace_back(w, i++);
+                return false;
             }
-            if (is.bad()) {
-                error("error while reading text " + filename);
-                return;
-            }
-            dbg(words.size());
+            bool use_stop_words = encoder->use_stop_words = vm.count("stop");
             int min_count = vm["min-count"].as<int>();
-            sort(execution::par_unseq, begin(words), end(words));
-            dbg("sorted");
-            vector<pair<int, int>> text;
-            for (int i = 0; i < (int)words.size();) {
-                std::string w = words[i].first;
-                int k = upper_bound(begin(words) + i, end(words), make_pair(w, INT_MAX)) - begin(words);
-                if (k - i >= min_count) {
-                    this->vocabulary.emplace_back(w);
-                    this->cnt.emplace_back(k - i);
-                    int id = this->vocabulary.size() - 1;
-                    for (int j = i; j < k; j++) {
-                        text.emplace_back(words[j].second, id);
+            int nb_threads = vm.count("thread") ? max(1, vm["thread"].as<int>()) : 1;
+            // The file is cut in one chunk per thread. Each chunk counts its words in
+            // nb_threads partitions (by the high bits of the hash, the low ones are used by
+            // the hash tables), so that partition p of every chunk can be merged by thread p.
+            struct Counter {
+                Vocabulary words;
+                vector<long long> counts;
+
+                void add(string_view w, size_t h, long long c) {
+                    int id = words.insert(w, h);
+                    if (id == (int)counts.size()) counts.emplace_back(0);
+                    counts[id] += c;
+                }
+            };
+            auto partition = [&](size_t h) {
+                return (int)((h >> 32) * nb_threads >> 32);
+            };
+            vector<string_view>& chunks = encoder->chunks = split(file.view(), nb_threads);
+            vector<vector<Counter>> local(nb_threads, vector<Counter>(nb_threads));
+            parallel_for(nb_threads, [&](int t) {
+                for_each_word(chunks[t], [&](string_view w) {
+                    if (use_stop_words && stopwords.contains(w)) return;
+                    size_t h = Vocabulary::hash(w);
+                    local[t][partition(h)].add(w, h, 1);
+                });
+            });
+            vector<Counter> words(nb_threads);
+            vector<vector<pair<string_view, long long>>> kept(nb_threads);
+            parallel_for(nb_threads, [&](int p) {
+                for (int t = 0; t < nb_threads; t++) {
+                    const Counter& counter = local[t][p];
+                    for (int i = 0; i < counter.words.size(); i++) {
+                        string_view w = counter.words[i];
+                        words[p].add(w, Vocabulary::hash(w), counter.counts[i]);
+                    }
+                }
+                for (int i = 0; i < words[p].words.size(); i++) {
+                    string_view w = words[p].words[i];
+                    if (words[p].counts[i] >= min_count || (base && base->vocabulary.contains(w))) {
+                        kept[p].emplace_back(w, words[p].counts[i]);
                     }
                 }
-                i = k;
+            });
+            vector<pair<string_view, long long>> vocabulary;
+            long long letters = 0;
+            for (const auto& k : kept) {
+                vocabulary.insert(end(vocabulary), begin(k), end(k));
+                for (const auto& [w, c] : k) letters += w.size();
             }
+            dbg(vocabulary.size());
+            // Ids by decreasing count (then in lexicographic order), so that the rows of the most
+            // frequent words are next to each other in the model
+            sort(execution::par_unseq, begin(vocabulary), end(vocabulary), [](const auto& w1, const auto& w2) {
+                return w1.second != w2.second ? w1.second > w2.second : w1.first < w2.first;
+            });
+            if (base) {
+                this->vocabulary = base->vocabulary;
+                this->cnt = base->cnt;
+            }
+            this->vocabulary.reserve(this->vocabulary.size() + vocabulary.size(), this->vocabulary.arena.size() + letters);
+            for (const auto& [w, c] : vocabulary) {
+                int id = this->vocabulary.insert(w);
+                if (id == (int)this->cnt.size()) this->cnt.emplace_back(0);
+                this->cnt[id] += c;
+            }
+            vector<Counter>{}.swap(words);
             dbg(this->vocabulary.size());
-            sort(execution::par_unseq, begin(text), end(text));
-            dbg(text.size());
-            for (const auto& p : text) {
-                this->text.emplace_back(p.second);
+            // Number of kept words in each chunk, to know where each chunk writes its ids
+            vector<long long>& offsets = encoder->offsets;
+            offsets.resize(nb_threads + 1);
+            parallel_for(nb_threads, [&](int t) {
+                for (int p = 0; p < nb_threads; p++) {
+                    const Counter& counter = local[t][p];
+                    for (int i = 0; i < counter.words.size(); i++) {
+                        if (this->vocabulary.contains(counter.words[i])) offsets[t + 1] += counter.counts[i];
+                    }
+                    local[t][p] = Counter{};
+                }
+            });
+            partial_sum(begin(offsets), end(offsets), begin(offsets));
+            build_sampling(vm["sample"].as<float>());
+            auto encode = [&](int t, auto output) {
+                for_each_word(chunks[t], [&](string_view w) {
+                    int id = encoder->id(this->vocabulary, w);
+                    if (id != -1) output(id);
+                });
+            };
+            if (!key || !vm.count("stream")) {
+                this->text.resize(offsets.back());
+                encoder->start(this->vocabulary, this->text.data());
+                this->encoder = std::move(encoder);
+            } else {
+                // Everything but the ids is written first, then each chunk writes its ids at
+                // its offset through a small buffer, so the ids never are all in memory.
+                string tmp = cache + ".tmp";
+                ofstream os{tmp, ios::binary};
+                if (!os.is_open()) {
+                    error("error while opening corpus cache " + tmp);
+                    return false;
+                }
+                this->stream = cache;
+                this->stream_size = offsets.back();
+                save_cache(os, *key);
+                this->stream_offset = os.tellp();
+                os.close();
+                FileDescriptor file{open(tmp.c_str(), O_RDWR)};
+                int fd = file.fd;
+                if (!os || fd == -1 || ftruncate(fd, this->stream_offset + this->stream_size * sizeof(int)) != 0) {
+                    error("error while saving corpus cache " + tmp);
+                    this->stream.clear();
+                    return false;
+                }
+                atomic<bool> ok = true;
+                parallel_for(nb_threads, [&](int t) {
+                    constexpr int buffer_size = 1 << 16;
+                    vector<int> buffer;
+                    buffer.reserve(buffer_size);
+                    off_t offset = this->stream_offset + offsets[t] * sizeof(int);
+                    auto flush = [&] {
+                        size_t size = buffer.size() * sizeof(int);
+                        if (pwrite(fd, buffer.data(), size, offset) != (ssize_t)size) ok = false;
+                        offset += size;
+                        buffer.clear();
+                    };
+                    encode(t, [&](int id) {
+                        buffer.emplace_back(id);
+                        if (buffer.size() == buffer_size) flush();
+                    });
+                    flush();
+                });
+                if (!ok || rename(tmp.c_str(), cache.c_str()) != 0) {
+                    error("error while saving corpus cache " + cache);
+                    remove(tmp.c_str());
+                    this->stream.clear();
+                    return false;
+                }
+                this->stream_file = std::move(file);
             }
             dbg(this->text.size());
 #ifdef DEBUG
-            for (int i = 0; i < min(1000, (int)text.size()); i++) {
+            wait(0, min(1000LL, (long long)this->text.size()));
+            for (long long i = 0; i < min(1000LL, (long long)this->text.size()); i++) {
                 cout << this->vocabulary[this->text[i]] << ' ';
             }
             cout << endl;
 #endif
         }
+        return true;
+    }
+
+    // The cache is only meant to be read back on the same machine, so the arrays are
+    // written in native byte order after the header below. The ids start on a multiple of
+    // ids_alignment bytes, so that they can be used from a mapping of the file.
+    static constexpr char cache_magic[8] = {'W', '2', 'V', 'C', 'A', 'C', 'H', 'E'};
+    static constexpr int cache_version = 6;
+    static constexpr long long ids_alignment = 64;
+
+    template<typename T>
+    static void write_value(std::ostream& os, const T& x) {
+        os.write(reinterpret_cast<const char*>(&x), sizeof(x));
+    }
+
+    template<typename T>
+    static bool read_value(std::string_view& s, T& x) {
+        if (s.size() < sizeof(x)) return false;
+        memcpy(&x, s.data(), sizeof(x));
+        s.remove_prefix(sizeof(x));
+        return true;
+    }
+
+    template<typename T>
+    static void write_array(std::ostream& os, const std::vector<T>& v) {
+        write_value(os, (long long)v.size());
+        os.write(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+    }
+
+    template<typename T>
+    static bool read_array(std::string_view& s, std::vector<T>& v) {
+        long long size;
+        if (!read_value(s, size) || size < 0 || s.size() / sizeof(T) < (size_t)size) return false;
+        v.resize(size);
+        memcpy(v.data(), s.data(), size * sizeof(T));
+        s.remove_prefix(size * sizeof(T));
+        return true;
+    }
+
+    void save_cache(std::ostream& os, const CacheKey& key) const {
+        os.write(cache_magic, sizeof(cache_magic));
+        write_value(os, cache_version);
+        write_value(os, key.file_size);
+        write_value(os, key.modification_time);
+        write_value(os, key.min_count);
+        write_value(os, key.stop);
+        write_value(os, key.sample);
+        os << key.train << '\0';
+        write_array(os, vocabulary.arena);
+        write_array(os, vocabulary.offsets);
+        write_array(os, vocabulary.table);
+        write_array(os, cnt);
+        write_array(os, subsampling);
+        write_array(os, unigram.table);
+        // With --stream, the ids are written afterwards by read
+        write_value(os, size());
+        long long padding = -(long long)os.tellp() & (ids_alignment - 1);
+        os.write(std::string(padding, '\0').data(), padding);
+        os.write(reinterpret_cast<const char*>(text.data()), text.size() * sizeof(int));
+    }
+
+    // Returns false, leaving the text untouched, if the cache is missing, corrupted or stale
+    // The ids are not copied: they are used from the mapping of the cache, or when streaming,
+    // only their position in the cache is kept.
+    bool load_cache(const std::string& filename, const CacheKey& key, bool stream) {
+        using namespace std;
+        FileDescriptor descriptor{open(filename.c_str(), O_RDONLY)};
+        auto cache_file = make_unique<MappedFile>(descriptor);
+        const MappedFile& file = *cache_file;
+        if (!file.is_open()) return false;
+        string_view s = file.view();
+        auto header = [&](auto& x) { return read_value(s, x); };
+        char magic[sizeof(cache_magic)];
+        int version;
+        long long file_size, modification_time;
+        int min_count, stop;
+        float sample;
+        if (!header(magic) || !equal(begin(magic), end(magic), cache_magic) ||
+            !header(version) || version != cache_version ||
+            !header(file_size) || !header(modification_time) ||
+            !header(min_count) || !header(stop) || !header(sample)) return false;
+        size_t train_end = s.find('\0');
+        if (train_end == string_view::npos) return false;
+        if (key.train != s.substr(0, train_end) || key.file_size != file_size ||
+            key.modification_time != modification_time || key.min_count != min_count ||
+            key.stop != stop || key.sample != sample) return false;
+        s.remove_prefix(train_end + 1);
+        Text res;
+        if (!read_array(s, res.vocabulary.arena) || !read_array(s, res.vocabulary.offsets) ||
+            !read_array(s, res.vocabulary.table) || res.vocabulary.offsets.empty() ||
+            res.vocabulary.offsets.back() != (long long)res.vocabulary.arena.size() ||
+            !has_single_bit(res.vocabulary.table.size()) ||
+            (long long)res.vocabulary.table.size() < 2LL * res.vocabulary.size()) return false;
+        int vocabulary_size = res.vocabulary.size();
+        // The training indexes the model with the ids and the aliases, and the subsampling with the ids
+        if (!read_array(s, res.cnt) || !read_array(s, res.subsampling) ||
+            !read_array(s, res.unigram.table) || (int)res.cnt.size() != vocabulary_size ||
+            res.subsampling.size() != (sample == 0 ? 0 : (size_t)vocabulary_size) ||
+            res.unigram.size() != vocabulary_size ||
+            !all_of(res.unigram.table.begin(), res.unigram.table.end(), [&](const AliasTable::Column& c) {
+                return (unsigned)c.alias < (unsigned)vocabulary_size;
+            })) return false;
+        long long size;
+        if (!header(size) || size < 0) return false;
+        long long offset = s.data() - file.data;
+        long long padding = -offset & (ids_alignment - 1);
+        if (s.size() < (size_t)padding || (s.size() - padding) / sizeof(int) < (size_t)size) return false;
+        offset += padding;
+        if (!stream) {
+            res.mapped = {reinterpret_cast<const int*>(file.data + offset), (size_t)size};
+            long long page = sysconf(_SC_PAGESIZE);
+            madvise(const_cast<char*>(file.data) + offset / page * page, offset % page + size * sizeof(int), MADV_WILLNEED);
+            // Checked once here, the streamed ids are checked by TokenReader as they are read
+            if (!all_of(execution::par_unseq, res.mapped.begin(), res.mapped.end(),
+                        [&](int id) { return (unsigned)id < (unsigned)vocabulary_size; })) return false;
+            res.cache_file = std::move(cache_file);
+        } else {
+            res.stream = filename;
+            res.stream_offset = offset;
+            res.stream_size = size;
+            res.stream_file = std::move(descriptor);
+        }
+        *this = std::move(res);
+        return true;
+    }
+
+    // Negative sampling and subsampling distributions
+    void build_sampling(float sample) {
+        using namespace std;
+        long long size = accumulate(begin(this->cnt), end(this->cnt), 0LL);
         {
-            // Unigram table
-            constexpr float power = 0.75;
-            constexpr int precision = 2e8;
-            float words_power = accumulate(begin(this->cnt), end(this->cnt), 1,
-                                           [&](float acc, int v) {
-                                               return acc + pow(v, power);
-                                           });
-            int ix = 0;
-            float p = pow(cnt[ix], power) / words_power;
-            for (int i = 0;; i++) {
-                this->unigram_table.emplace_back(ix);
-                if (i > p * precision) {
-                    ix++;
-                    if (ix == (int)this->cnt.size()) break;
-                    p += pow(this->cnt[ix], power) / words_power;
-                }
+            // Negative sampling distribution
+            constexpr double power = 0.75;
+            this->unigram = AliasTable(this->cnt, power);
+#ifdef DEBUG
+            vector<double> exact(begin(this->cnt), end(this->cnt));
+            double words_power = 0;
+            for (double& x : exact) words_power += x = pow(x, power);
+            vector<double> distribution = this->unigram.distribution();
+            double total_variation = 0;
+            for (int i = 0; i < (int)exact.size(); i++) {
+                total_variation += abs(distribution[i] - exact[i] / words_power) / 2;
             }
-            dbg(unigram_table.size());
+            dbg(total_variation);
+#endif
         }
         {
             // Subsampling
-            float sample = vm["sample"].as<float>();
             if (sample == 0) return;
             this->subsampling.resize(this->vocabulary.size());
             for (int i = 0; i < (int)this->vocabulary.size(); i++) {
-                float x = cnt[i] / (float)this->text.size();
+                double x = cnt[i] / (double)size;
                 this->subsampling[i] = (sqrt(x / sample) + 1) * (sample / x);
                 if (this->subsampling[i] < 1) dbg(this->subsampling[i]);
             }
         }
     }
+
+    Text() = default;
+
+    // See read for the base, the corpus cache is not used with a base
+    Text(const po::variables_map& vm, const Text* base = nullptr) {
+        using namespace std;
+        optional<CacheKey> key;
+        string cache;
+        if (vm.count("corpus-cache") && !base) {
+            cache = vm["corpus-cache"].as<string>();
+            key.emplace(vm);
+            if (load_cache(cache, *key, vm.count("stream"))) {
+                dbg("corpus loaded from cache", cache);
+                return;
+            }
+        }
+        if (!read(vm, cache, key, base)) return;
+        if (key && stream.empty()) {
+            wait(0, size());
+            // Written next to the cache and renamed, so that an interrupted run never leaves a truncated cache
+            string tmp = cache + ".tmp";
+            ofstream os{tmp, ios::binary};
+            if (!os.is_open()) {
+                error("error while opening corpus cache " + tmp);
+                return;
+            }
+            save_cache(os, *key);
+            os.close();
+            if (!os || rename(tmp.c_str(), cache.c_str()) != 0) {
+                error("error while saving corpus cache " + cache);
+                remove(tmp.c_str());
+            }
+        }
+    }
 };
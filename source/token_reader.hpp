@@ -0,0 +1,69 @@
+#pragma once
+
+#include <span>
+#include <vector>
+#include <climits>
+#include <algorithm>
+#include <iostream>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include "util.hpp"
+#include "text.hpp"
+
+// Reads the ids of a text by blocks. When the ids are in memory, a whole range is
+// returned at once. When they are streamed from the corpus cache (--stream), they are
+// read with pread from the file opened by the text, in a buffer of `block` ids, and the
+// kernel can be asked to read ahead the next block while the current one is used.
+struct TokenReader {
+    const Text& text;
+    long long block;
+    std::vector<int> buffer;
+
+    TokenReader(const Text& text, long long block)
+        : text(text), block(text.stream.empty() ? LLONG_MAX : std::max(1LL, block)) {
+        if (!text.stream.empty()) buffer.resize(this->block);
+    }
+
+    TokenReader(const TokenReader&) = delete;
+    TokenReader& operator=(const TokenReader&) = delete;
+
+    off_t offset(long long position) const {
+        return text.stream_offset + position * sizeof(int);
+    }
+
+    // Ids of the words in [begin, end). In memory, waits for them to be encoded. Streamed, the buffer
+    // grows if end - begin > block, and the ids which are not in the vocabulary end the block.
+    std::span<const int> read(long long begin, long long end) {
+        if (text.stream.empty()) {
+            text.wait(begin, end);
+            return text.ids().subspan(begin, end - begin);
+        }
+        if (end - begin > (long long)buffer.size()) buffer.resize(end - begin);
+        char* data = reinterpret_cast<char*>(buffer.data());
+        size_t size = (end - begin) * sizeof(int);
+        size_t done = 0;
+        while (done < size) {
+            ssize_t n = pread(text.stream_file.fd, data + done, size - done, offset(begin) + done);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) {
+                error("error while reading " + text.stream);
+                break;
+            }
+            done += n;
+        }
+        long long n = done / sizeof(int);
+        int vocabulary_size = text.vocabulary.size();
+        long long valid = std::find_if(buffer.data(), buffer.data() + n, [&](int id) {
+            return (unsigned)id >= (unsigned)vocabulary_size;
+        }) - buffer.data();
+        if (valid < n) std::cerr << "ids out of the vocabulary in " << text.stream << std::endl;
+        return {buffer.data(), (size_t)valid};
+    }
+
+    // Asks the kernel to start reading [begin, end) in the background
+    void prefetch(long long begin, long long end) const {
+        if (text.stream.empty() || begin >= end) return;
+        posix_fadvise(text.stream_file.fd, offset(begin), (end - begin) * sizeof(int), POSIX_FADV_WILLNEED);
+    }
+};
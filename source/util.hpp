@@ -5,8 +5,36 @@
 #include <iostream>
 #include <concepts>
 #include <bit>
+#include <span>
+#include <type_traits>
+#include <cassert>
+#include <cmath>
+#include <memory>
 
 #include "debug.hpp"
+#include "vocabulary.hpp"
+#include "matrix.hpp"
+
+// Allocator whose values are left uninitialized by resize, for vectors entirely written afterwards
+template<typename T>
+struct default_init_allocator : std::allocator<T> {
+    template<typename U>
+    struct rebind {
+        using other = default_init_allocator<U>;
+    };
+
+    using std::allocator<T>::allocator;
+
+    template<typename U>
+    void construct(U* p) noexcept(std::is_nothrow_default_constructible_v<U>) {
+        ::new (static_cast<void*>(p)) U;
+    }
+
+    template<typename U, typename... Args>
+    void construct(U* p, Args&&... args) {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+};
 
 inline static auto error = [](const std::string& msg) {
     perror(msg.c_str());
@@ -22,9 +50,7 @@ T load_number(std::istream& is) {
     int size = sizeof(x);
     char* data = reinterpret_cast<char*>(&x);
     if constexpr (std::endian::native == std::endian::little) {
-        for (int i = 0; i < size; i++) {
-            is.read(&data[i], 1);
-        }
+        is.read(data, size);
     } else {
         for (int i = size - 1; i >= 0; i--) {
             is.read(&data[i], 1);
@@ -54,33 +80,81 @@ void save_number(std::ostream& os, T x) {
 
 inline static auto load = [](std::istream& is) {
     using namespace std;
-    pair<vector<string>, vector<vector<float>>> res;
+    pair<Vocabulary, Matrix<float>> res;
     int vocabulary_size = load_number<int>(is);
     dbg(vocabulary_size);
+    string w;
     for (int i = 0; i < vocabulary_size; i++) {
-        string w;
         is >> w;
-        res.first.emplace_back(w);
+        res.first.insert(w);
     }
     is.ignore();
     int embedding_size = load_number<int>(is);
     dbg(embedding_size);
-    vector<vector<float>> syn0(vocabulary_size, vector<float>(embedding_size));
+    Matrix<float> syn0(vocabulary_size, embedding_size);
     float m = 0;
     for (int i = 0; i < vocabulary_size; i++) {
-        for (int j = 0; j < embedding_size; j++) {
-            syn0[i][j] = load_number<float>(is);
-            m = std::max(m, abs(syn0[i][j]));
+        // A row at once in little endian, the order of the file
+        if constexpr (std::endian::native == std::endian::little) {
+            is.read(reinterpret_cast<char*>(syn0.row(i)), embedding_size * sizeof(float));
+        } else {
+            for (float& x : syn0[i]) x = load_number<float>(is);
         }
+        for (float x : syn0[i]) m = std::max(m, abs(x));
     }
     dbg(m);
     res.second = std::move(syn0);
     return res;
 };
 
+// Optional end of a model file, after the embeddings: the count of each word and the
+// output layer weights (syn1neg1), which are needed to go on training the model.
+inline static const std::string output_layer_marker = "syn1neg1";
+
+inline static auto save_output_layer = [](std::ostream& os, const auto& cnt, const auto& syn1neg1) {
+    os << output_layer_marker;
+    for (auto c : cnt) {
+        save_number(os, (long long)c);
+    }
+    for (int i = 0; i < syn1neg1.size(); i++) {
+        for (float weight : syn1neg1[i]) {
+            save_number(os, weight);
+        }
+    }
+};
+
+// Returns an empty vector and matrix if the model has no output layer
+inline static auto load_output_layer = [](std::istream& is, int vocabulary_size, int embedding_size) {
+    using namespace std;
+    pair<vector<long long>, Matrix<float>> res;
+    string marker(output_layer_marker.size(), ' ');
+    is.read(marker.data(), marker.size());
+    if (!is || marker != output_layer_marker) {
+        is.clear();
+        return res;
+    }
+    for (int i = 0; i < vocabulary_size; i++) {
+        res.first.emplace_back(load_number<long long>(is));
+    }
+    res.second = Matrix<float>(vocabulary_size, embedding_size);
+    for (int i = 0; i < vocabulary_size; i++) {
+        for (float& weight : res.second[i]) {
+            weight = load_number<float>(is);
+        }
+    }
+    return res;
+};
+
+// The right operands are spans, so that they can be vectors or rows of a Matrix
 template<typename T>
-std::vector<T>& operator+=(std::vector<T>& v1, const std::vector<T>& v2) {
-    if (v1.size() == 0) return v1 = v2;
+using span_of = std::type_identity_t<std::span<const T>>;
+
+template<typename T>
+std::vector<T>& operator+=(std::vector<T>& v1, span_of<T> v2) {
+    if (v1.size() == 0) {
+        v1.assign(v2.begin(), v2.end());
+        return v1;
+    }
     if (v2.size() == 0) return v1;
     assert(v1.size() == v2.size());
     for (int i = 0; i < (int)v1.size(); i++) {
@@ -89,6 +163,15 @@ std::vector<T>& operator+=(std::vector<T>& v1, const std::vector<T>& v2) {
     return v1;
 }
 
+template<typename T>
+std::span<T> operator+=(std::span<T> v1, span_of<T> v2) {
+    assert(v1.size() == v2.size());
+    for (int i = 0; i < (int)v1.size(); i++) {
+        v1[i] += v2[i];
+    }
+    return v1;
+}
+
 template<typename T, typename U>
 std::vector<T>& operator/=(std::vector<T>& v, U x) {
     for (int i = 0; i < (int)v.size(); i++) {
@@ -97,15 +180,6 @@ std::vector<T>& operator/=(std::vector<T>& v, U x) {
     return v;
 }
 
-template<typename T, typename U>
-std::vector<T> operator*(const std::vector<T>& v, U x) {
-    std::vector<T> res = v;
-    for (int i = 0; i < (int)res.size(); i++) {
-        res[i] *= x;
-    }
-    return res;
-}
-
 template<typename T>
 T sigmoid(T x) {
     return 1 / (1 + exp(-x));
@@ -133,6 +207,14 @@ weighted_vector<T> normalize(const weighted_vector<T>& v) {
     return res;
 }
 
+template<typename T>
+weighted_vector<T>& normalize_in_place(weighted_vector<T>& v) {
+    if (v.second == 0) return v;
+    v.first /= v.second;
+    v.second = 1;
+    return v;
+}
+
 template<typename T>
 weighted_vector<T>& operator+=(weighted_vector<T>& v1, const weighted_vector<T>& v2) {
     if (v1.second == 0) return v1 = v2;
@@ -147,9 +229,9 @@ weighted_vector<T>& operator+=(weighted_vector<T>& v1, const weighted_vector<T>&
 }
 
 template<typename T>
-weighted_vector<T>& operator+=(weighted_vector<T>& v1, const std::vector<T>& v2) {
+weighted_vector<T>& operator+=(weighted_vector<T>& v1, span_of<T> v2) {
     if (v1.second == 0) {
-        v1.first = v2;
+        v1.first.assign(v2.begin(), v2.end());
         if (v2.size() == 0) {
             dbg(v2);
         }
@@ -169,20 +251,44 @@ std::vector<T>& operator+=(std::vector<T>& v1, const weighted_vector<T>& v2) {
         dbg(v1, v2);
     }
     assert(v1.size() == v2.first.size());
-    v1 += normalize(v2).first;
+    for (int i = 0; i < (int)v1.size(); i++) {
+        v1[i] += v2.first[i] / v2.second;
+    }
     return v1;
 }
 
+template<typename T>
+std::span<T> operator+=(std::span<T> v1, const weighted_vector<T>& v2) {
+    if (v2.second == 0) return v1;
+    assert(v1.size() == v2.first.size());
+    for (int i = 0; i < (int)v1.size(); i++) {
+        v1[i] += v2.first[i] / v2.second;
+    }
+    return v1;
+}
+
+// v += x * a, where x has the given weight. Unlike v += x * a, no temporary vector is made,
+// and v only allocates the first time something is added to it.
 template<typename T, typename U>
-weighted_vector<T>& operator/=(weighted_vector<T>& v, U x) {
-    v.first /= x;
+weighted_vector<T>& add_scaled(weighted_vector<T>& v, span_of<T> x, U a, int weight = 1) {
+    if (weight == 0) return v;
+    if (v.second == 0) v.first.assign(x.size(), 0);
+    assert(v.first.size() == x.size());
+    for (int i = 0; i < (int)x.size(); i++) {
+        v.first[i] += x[i] * a;
+    }
+    v.second += weight;
     return v;
 }
 
 template<typename T, typename U>
-weighted_vector<T> operator*(const weighted_vector<T>& v, U x) {
-    weighted_vector<T> res;
-    res.first = v.first * x;
-    res.second = v.second;
-    return res;
+weighted_vector<T>& add_scaled(weighted_vector<T>& v, const weighted_vector<T>& x, U a) {
+    return add_scaled(v, x.first, a, x.second);
+}
+
+template<typename T, typename U>
+weighted_vector<T>& operator/=(weighted_vector<T>& v, U x) {
+    v.first /= x;
+    return v;
 }
+
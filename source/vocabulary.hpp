@@ -0,0 +1,117 @@
+#pragma once
+
+#include <vector>
+#include <string_view>
+#include <functional>
+#include <initializer_list>
+
+// Set of words with consecutive ids. The words are stored one after the other in a single
+// arena, and found back with an open addressing hash table (linear probing) keyed by
+// string_view, so adding or looking for a word never allocates per word.
+struct Vocabulary {
+    struct Slot {
+        int id = -1;
+        unsigned hash;
+    };
+    std::vector<char> arena;
+    // Word i is arena[offsets[i], offsets[i + 1])
+    std::vector<long long> offsets{0};
+    // Power of 2 size, at most half full
+    std::vector<Slot> table;
+
+    Vocabulary() = default;
+
+    Vocabulary(std::initializer_list<std::string_view> words) {
+        for (std::string_view w : words) insert(w);
+    }
+
+    static size_t hash(std::string_view w) {
+        return std::hash<std::string_view>{}(w);
+    }
+
+    int size() const {
+        return offsets.size() - 1;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    std::string_view operator[](int id) const {
+        return {arena.data() + offsets[id], size_t(offsets[id + 1] - offsets[id])};
+    }
+
+    // Id of w, -1 if w is not in the vocabulary
+    int find(std::string_view w, size_t h) const {
+        if (table.empty()) return -1;
+        size_t mask = table.size() - 1;
+        for (size_t i = h & mask;; i = (i + 1) & mask) {
+            const Slot& slot = table[i];
+            if (slot.id == -1) return -1;
+            if (slot.hash == (unsigned)h && (*this)[slot.id] == w) return slot.id;
+        }
+    }
+
+    int find(std::string_view w) const {
+        return find(w, hash(w));
+    }
+
+    bool contains(std::string_view w) const {
+        return find(w) != -1;
+    }
+
+    // Id of w, which is added at the end of the vocabulary if needed
+    int insert(std::string_view w, size_t h) {
+        if (2 * (size() + 1) > (int)table.size()) rehash(std::max<size_t>(16, 2 * table.size()));
+        size_t mask = table.size() - 1;
+        size_t i = h & mask;
+        for (; table[i].id != -1; i = (i + 1) & mask) {
+            if (table[i].hash == (unsigned)h && (*this)[table[i].id] == w) return table[i].id;
+        }
+        table[i] = {size(), (unsigned)h};
+        arena.insert(arena.end(), w.begin(), w.end());
+        offsets.emplace_back(arena.size());
+        return table[i].id;
+    }
+
+    int insert(std::string_view w) {
+        return insert(w, hash(w));
+    }
+
+    void rehash(size_t table_size) {
+        std::vector<Slot> old(table_size);
+        std::swap(old, table);
+        size_t mask = table.size() - 1;
+        for (const Slot& slot : old) {
+            if (slot.id == -1) continue;
+            size_t i = slot.hash & mask;
+            while (table[i].id != -1) i = (i + 1) & mask;
+            table[i] = slot;
+        }
+    }
+
+    // Room for n words with a total of `letters` characters
+    void reserve(int n, long long letters) {
+        arena.reserve(letters);
+        offsets.reserve(n + 1);
+        size_t table_size = 16;
+        while (table_size < 2 * (size_t)n) table_size *= 2;
+        if (table_size > table.size()) rehash(table_size);
+    }
+
+    struct iterator {
+        const Vocabulary* vocabulary;
+        int id;
+        std::string_view operator*() const { return (*vocabulary)[id]; }
+        iterator& operator++() { id++; return *this; }
+        bool operator==(const iterator&) const = default;
+    };
+
+    iterator begin() const {
+        return {this, 0};
+    }
+
+    iterator end() const {
+        return {this, size()};
+    }
+};
@@ -2,6 +2,7 @@
 #include <boost/program_options.hpp>
 #include <string>
 #include <vector>
+#include <array>
 #include <fstream>
 #include <concepts>
 #include <ranges>
@@ -13,8 +14,21 @@
 #include <chrono>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "util.hpp"
 #include "text.hpp"
+#include "token_reader.hpp"
+#include "kernels.hpp"
+#include "huffman.hpp"
+#include "scheduler.hpp"
+#include "numa.hpp"
+#include "half.hpp"
+#include "checkpoint.hpp"
+#include "sliding_window.hpp"
 
 namespace po = boost::program_options;
 
@@ -23,128 +37,563 @@ static std::thread::id print_id;
 struct WordEmbedding {
     std::vector<std::mutex> syn0_mutex;
     std::vector<std::mutex> syn1neg1_mutex;
-    std::vector<std::vector<float>> syn0;
-    std::vector<std::vector<float>> syn1neg1;
+    std::vector<std::mutex> syn1_mutex;
+    // Without locks, the threads update the rows concurrently like the reference implementation
+    bool hogwild = false;
+    // Number of consecutive positions sharing their negative samples
+    int batch = 1;
+    std::atomic<long long> words_processed = 0;
+    // Words of the text read so far, subsampled or not, which give the learning rate
+    std::atomic<long long> words_read = 0;
+    Matrix<float> syn0;
+    Matrix<float> syn1neg1;
+    // syn0 and syn1neg1 when they are stored in 16 bits for the training, the fp32 matrix being empty
+    HalfMatrix syn0_half;
+    HalfMatrix syn1neg1_half;
+    // Hierarchical softmax: the internal nodes of the tree, empty when it is not used
+    HuffmanTree tree;
+    Matrix<float> syn1;
+    // Position of each training thread, and the pause of the threads for the checkpoints
+    std::vector<WorkerState> states;
+    Pause pause;
+    inline static const std::string checkpoint_marker = "word2vec checkpoint 3 ";
+    // Process writing the last checkpoint
+    pid_t checkpoint_writer = 0;
     const Text& text;
 
-    WordEmbedding(int size, const Text& text) : text(text) {
-        init(size, text.vocabulary.size());
+    // A new model may be stored in 16 bits from the start, without the fp32 matrices
+    WordEmbedding(int size, const Text& text, Precision syn0_precision = Precision::fp32,
+                  Precision syn1neg1_precision = Precision::fp32, bool stochastic = false)
+        : text(text) {
+        init(size, text.vocabulary.size(), syn0_precision, syn1neg1_precision, stochastic);
     }
 
-    void init(int size, int vocab_size) {
+    void init(int size, int vocab_size, Precision syn0_precision = Precision::fp32,
+              Precision syn1neg1_precision = Precision::fp32, bool stochastic = false) {
         using namespace std;
         syn0_mutex = vector<mutex>(vocab_size);
         syn1neg1_mutex = vector<mutex>(vocab_size);
-        syn0.resize(vocab_size, vector<float>(size));
-        syn1neg1.resize(vocab_size, vector<float>(size));
+        syn0 = Matrix<float>();
+        syn1neg1 = Matrix<float>();
+        syn0_half = HalfMatrix();
+        syn1neg1_half = HalfMatrix();
+        if (syn0_precision == Precision::fp32) {
+            syn0 = Matrix<float>(vocab_size, size);
+        } else {
+            syn0_half = HalfMatrix(vocab_size, size, syn0_precision, stochastic);
+        }
+        if (syn1neg1_precision == Precision::fp32) {
+            syn1neg1 = Matrix<float>(vocab_size, size);
+        } else {
+            syn1neg1_half = HalfMatrix(vocab_size, size, syn1neg1_precision, stochastic);
+        }
         default_random_engine generator;
         uniform_real_distribution<float> distribution(-0.5, 0.5);
-        for (auto& hidden2output : syn1neg1) {
-            for (float& weight : hidden2output) {
-                weight = distribution(generator);
+        vector<float> row(size);
+        for (int i = 0; i < vocab_size; i++) {
+            float* weights = syn1neg1.empty() ? row.data() : syn1neg1.row(i);
+            for (int j = 0; j < size; j++) {
+                weights[j] = distribution(generator);
             }
+            if (syn1neg1.empty()) syn1neg1_half.store(i, weights);
         }
     }
 
     int embedding_dim() const {
-        return syn0[0].size();
+        return syn0_half.empty() ? syn0.cols : syn0_half.cols();
+    }
+
+    void set_precision(Precision syn0_precision, Precision syn1neg1_precision, bool stochastic) {
+        // The matrices already stored in 16 bits by the constructor are kept
+        if (syn0_precision != Precision::fp32 && syn0_half.empty()) {
+            syn0_half = HalfMatrix(syn0, syn0_precision, stochastic);
+            syn0 = Matrix<float>();
+        }
+        if (syn1neg1_precision != Precision::fp32 && syn1neg1_half.empty()) {
+            syn1neg1_half = HalfMatrix(syn1neg1, syn1neg1_precision, stochastic);
+            syn1neg1 = Matrix<float>();
+        }
+        syn0_half.relaxed = hogwild;
+        syn1neg1_half.relaxed = hogwild;
+    }
+
+    // Kernels on the rows of the model. With --hogwild, other threads update the rows at the same
+    // time: the relaxed kernels access them through relaxed atomics.
+    const Kernels& kernels() const {
+        static const Kernels relaxed = Kernels::relaxed();
+        return hogwild ? relaxed : Kernels::get();
+    }
+
+    // Row of the thread to compute on a row stored in 16 bits
+    float* scratch_row() {
+        thread_local std::vector<float> row;
+        row.resize(embedding_dim());
+        return row.data();
+    }
+
+    void use_hierarchical_softmax() {
+        tree = HuffmanTree(text.cnt);
+        syn1 = Matrix<float>(tree.size(), embedding_dim());
+        // Random as syn1neg1: syn0 starts at 0, so with both at 0 no gradient would ever flow
+        std::default_random_engine generator;
+        std::uniform_real_distribution<float> distribution(-0.5, 0.5);
+        for (int i = 0; i < syn1.rows; i++) {
+            for (float& weight : syn1[i]) {
+                weight = distribution(generator);
+            }
+        }
+        syn1_mutex = std::vector<std::mutex>(tree.size());
+    }
+
+    void start_workers(int nb_threads, uint64_t seed) {
+        states = std::vector<WorkerState>(nb_threads);
+        for (int t = 0; t < nb_threads; t++) states[t].sampler = Sampler(seed, t);
+        pause.running = nb_threads;
     }
 
-    void learn(const std::pair<int, int>& slice, float starting_alpha,
-               int window, int negative, int max_iter) {
+    // Trains on the chunks given by the scheduler until there is none left. The learning rate
+    // decreases with the number of words read by all the threads.
+    void learn(Scheduler& scheduler, int thread, float starting_alpha, int window, int negative,
+               int max_iter, long long buffer, std::chrono::steady_clock::time_point start,
+               WorkerStats& stats) {
         using namespace std;
-        const int vocab_size = text.vocabulary.size();
-        default_random_engine generator(chrono::system_clock::now().time_since_epoch().count());
-        uniform_real_distribution<float> distribution(0, 1);
-        for (int iter = 0; iter < max_iter; iter++) {
-            if (this_thread::get_id() == print_id) dbg(iter);
-            vector<int> sentence;
-            // Subsampling of frequent words
-            for (int i = slice.first; i < slice.second; i++) {
-                if (text.subsampling.size() &&
-                    text.subsampling[text.text[i]] < distribution(generator)) continue;
-                sentence.emplace_back(text.text[i]);
-            }
-            int sentence_length = sentence.size();
-//            dbg(sentence_length);
-            float alpha = starting_alpha * (1 - (float)iter / max_iter);
-            for (int sentence_pos = 0; sentence_pos < sentence_length; sentence_pos++) {
-                int word = sentence[sentence_pos];
-                // This vector will hold the *average* of all of the context word vectors.
-                // This is the output of the hidden layer.
-                vector<float> neu1(embedding_dim());
-                // Holds the gradient for updating the hidden layer weights.
-                // This same gradient update is applied to all context word vectors.
-                vector<float> neu1e(embedding_dim());
-                int cw = 0;
-                for (int i = 0; i < 2 * window + 1; i++) {
-                    if (i == window) continue;
-                    int j = sentence_pos - window + i;
-                    if (j < 0) continue;
-                    if (j >= sentence_length) continue;
-                    int context_word = sentence[j];
-                    syn0_mutex[context_word].lock();
-                    neu1 += syn0[context_word];
-                    syn0_mutex[context_word].unlock();
-                    cw++;
+        WorkerState& state = states[thread];
+        // The positions of a group of the batch and their contexts
+        state.words.reserve(2 * window + batch);
+        TokenReader reader{text, buffer};
+        long long total_words = max_iter * text.size();
+        int last_iter = -1;
+        while (true) {
+            // A resumed thread first ends the item it was on
+            if (!state.item) {
+                state.stolen = false;
+                state.item = scheduler.pop(thread);
+                if (!state.item) {
+                    state.item = scheduler.steal(thread);
+                    state.stolen = true;
                 }
-                [[unlikely]] if (cw == 0) continue;
-                neu1 /= cw;
-                for (int sample = 0; sample < negative + 1; sample++) {
-                    int target, label;
-                    if (sample == 0) {
-                        target = word;
-                        label = 1;
-                    } else {
-                        uniform_int_distribution<int> negative_sample(0, (int)text.unigram_table.size() - 1);
-                        do {
-                            target = text.unigram_table[negative_sample(generator)];
-                        } while (target == word);
-                        label = 0;
+                if (!state.item) break;
+                state.block = state.block_end = state.item->begin;
+            }
+            const Scheduler::Item& item = *state.item;
+            auto chunk_start = chrono::steady_clock::now();
+            if (this_thread::get_id() == print_id && item.iteration != last_iter) {
+                last_iter = item.iteration;
+                dbg(last_iter);
+            }
+            while (state.block < item.end) {
+                // Unless the block was started before a checkpoint
+                bool started = state.block_end > state.block;
+                if (!started) {
+                    state.alpha = learning_rate(starting_alpha, words_read, total_words);
+                    state.block_end = state.block + min(item.end - state.block, reader.block);
+                }
+                span<const int> ids = reader.read(state.block, state.block_end);
+                if (stats.first_update < 0) {
+                    stats.first_update = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                }
+                if (started) {
+                    state.words.ids = ids;
+                } else {
+                    // Read ahead the next block, or the start of the next chunk
+                    if (state.block_end < item.end) {
+                        reader.prefetch(state.block_end, state.block_end + min(item.end - state.block_end, reader.block));
+                    } else if (optional<Scheduler::Item> next = scheduler.peek(thread)) {
+                        reader.prefetch(next->begin, next->begin + min(next->end - next->begin, reader.block));
                     }
-                    syn1neg1_mutex[target].lock();
-                    float dot_product = inner_product(begin(neu1), end(neu1),
-                                                      begin(syn1neg1[target]), (float)0);
-                    float error = label - sigmoid(dot_product);
-                    //error *= sigmoid_derivative(dot_product);
-                    neu1e += syn1neg1[target] * error;
-                    syn1neg1[target] += neu1 * error * alpha;
-                    syn1neg1_mutex[target].unlock();
+                    state.words.start(ids);
+                    state.position = 0;
+                }
+                if (batch > 1 && negative > 0) {
+                    learn_batched(state, window, negative);
+                } else {
+                    learn(state, window, negative);
+                }
+                words_processed += state.words.end;
+                words_read += state.block_end - state.block;
+                state.block = state.block_end;
+            }
+            auto chunk_end = chrono::steady_clock::now();
+            double seconds = chrono::duration<double>(chunk_end - chunk_start).count();
+            stats.chunks++;
+            stats.stolen += state.stolen;
+            stats.busy += seconds;
+            stats.finished = chrono::duration<double>(chunk_end - start).count();
+            stats.chunk_seconds.emplace_back(seconds);
+            state.item.reset();
+        }
+        pause.leave();
+    }
+
+    // Parks the thread for a checkpoint if one is requested, `position` being the next position to train on
+    void checkpoint_point(WorkerState& state, long long position) {
+        if (!pause.requested.load(std::memory_order_relaxed)) [[likely]] return;
+        state.position = position;
+        pause.park();
+    }
+
+    // Trains on the block of the state from its position. The words are subsampled on the fly,
+    // up to `window` positions ahead.
+    void learn(WorkerState& state, int window, int negative) {
+        using namespace std;
+        SlidingWindow& words = state.words;
+        float alpha = state.alpha;
+        int dim = embedding_dim();
+        // Scratch vectors of the thread, so that no position allocates
+        thread_local array<vector<float>, 2> scratch;
+        // This vector will hold the *average* of all of the context word vectors.
+        // This is the output of the hidden layer.
+        vector<float>& neu1 = scratch[0];
+        // Holds the gradient for updating the hidden layer weights.
+        // This same gradient update is applied to all context word vectors.
+        vector<float>& neu1e = scratch[1];
+        neu1.resize(dim);
+        neu1e.resize(dim);
+        for (long long sentence_pos = state.position;
+             words.fill(sentence_pos + window, state.sampler, text.subsampling) > sentence_pos; sentence_pos++) {
+            checkpoint_point(state, sentence_pos);
+            int word = words[sentence_pos];
+            fill(neu1e.begin(), neu1e.end(), 0.0f);
+            [[unlikely]] if (context(words, sentence_pos, window, neu1.data()) == 0) continue;
+            hierarchical_softmax(word, neu1.data(), neu1e.data(), alpha);
+            for (int sample = 0; negative > 0 && sample < negative + 1; sample++) {
+                int target, label;
+                if (sample == 0) {
+                    target = word;
+                    label = 1;
+                } else {
+                    do {
+                        target = state.sampler.negative(text.unigram);
+                    } while (target == word);
+                    label = 0;
+                }
+                output(target, label, neu1.data(), neu1e.data(), alpha);
+            }
+            update_context(words, sentence_pos, window, neu1e.data(), alpha);
+        }
+    }
+
+    // Same as learn, except that each group of `batch` consecutive positions shares the same
+    // negative samples, so that their dot products and updates are two small matrix products
+    // instead of batch * negative separate passes over random rows of syn1neg1.
+    void learn_batched(WorkerState& state, int window, int negative) {
+        using namespace std;
+        const Kernels& k = Kernels::get();
+        SlidingWindow& words = state.words;
+        float alpha = state.alpha;
+        int dim = embedding_dim();
+        // neu1 and neu1e of each position of the group, the rows of the negative samples and
+        // their updates
+        thread_local Matrix<float> neu1, neu1e, negatives, negatives_update;
+        thread_local vector<float> errors, errors_transposed;
+        thread_local vector<int> ids;
+        thread_local vector<char> valid;
+        if (neu1.rows != batch || neu1.cols != dim) {
+            neu1 = Matrix<float>(batch, dim);
+            neu1e = Matrix<float>(batch, dim);
+        }
+        if (negatives.rows != negative || negatives.cols != dim) {
+            negatives = Matrix<float>(negative, dim);
+            negatives_update = Matrix<float>(negative, dim);
+        }
+        errors.resize(batch * negative);
+        errors_transposed.resize(negative * batch);
+        ids.resize(negative);
+        valid.resize(batch);
+        for (long long group = state.position;
+             words.fill(group + batch - 1 + window, state.sampler, text.subsampling) > group; group += batch) {
+            checkpoint_point(state, group);
+            int n = min<long long>(batch, words.end - group);
+            for (int b = 0; b < n; b++) {
+                int word = words[group + b];
+                fill_n(neu1e.row(b), dim, 0.0f);
+                valid[b] = context(words, group + b, window, neu1.row(b)) > 0;
+                if (!valid[b]) continue;
+                hierarchical_softmax(word, neu1.row(b), neu1e.row(b), alpha);
+                output(word, 1, neu1.row(b), neu1e.row(b), alpha);
+            }
+            for (int j = 0; j < negative; j++) {
+                ids[j] = state.sampler.negative(text.unigram);
+                if (!hogwild) syn1neg1_mutex[ids[j]].lock();
+                if (syn1neg1_half.empty()) {
+                    fill_n(negatives.row(j), dim, 0.0f);
+                    kernels().axpy(1, syn1neg1.row(ids[j]), negatives.row(j), dim);
+                } else {
+                    syn1neg1_half.load(ids[j], negatives.row(j));
                 }
-                for (int i = 0; i < 2 * window + 1; i++) {
-                    if (i == window) continue;
-                    int j = sentence_pos - window + i;
-                    if (j < 0) continue;
-                    if (j >= sentence_length) continue;
-                    int context_word = sentence[j];
-                    syn0_mutex[context_word].lock();
-                    syn0[context_word] += neu1e * alpha;
-                    syn0_mutex[context_word].unlock();
+                if (!hogwild) syn1neg1_mutex[ids[j]].unlock();
+            }
+            k.gemm_nt(n, negative, dim, neu1.data, neu1.stride, negatives.data, negatives.stride,
+                      errors.data(), negative);
+            for (int b = 0; b < n; b++) {
+                for (int j = 0; j < negative; j++) {
+                    // A negative sample equal to the word of the position is ignored for this position
+                    float& error = errors[b * negative + j];
+                    error = valid[b] && ids[j] != words[group + b] ? -sigmoid(error) : 0;
+                    errors_transposed[j * batch + b] = error * alpha;
                 }
             }
+            // neu1e += errors * negatives, then negatives += alpha * errors^T * neu1
+            k.gemm_nn(n, negative, dim, errors.data(), negative, negatives.data, negatives.stride,
+                      neu1e.data, neu1e.stride);
+            fill_n(negatives_update.data, negatives_update.rows * negatives_update.stride, 0.0f);
+            k.gemm_nn(negative, n, dim, errors_transposed.data(), batch, neu1.data, neu1.stride,
+                      negatives_update.data, negatives_update.stride);
+            for (int j = 0; j < negative; j++) {
+                if (!hogwild) syn1neg1_mutex[ids[j]].lock();
+                if (syn1neg1_half.empty()) {
+                    kernels().axpy(1, negatives_update.row(j), syn1neg1.row(ids[j]), dim);
+                } else {
+                    float* row = scratch_row();
+                    syn1neg1_half.load(ids[j], row);
+                    k.axpy(1, negatives_update.row(j), row, dim);
+                    syn1neg1_half.store(ids[j], row);
+                }
+                if (!hogwild) syn1neg1_mutex[ids[j]].unlock();
+            }
+            for (int b = 0; b < n; b++) {
+                if (valid[b]) update_context(words, group + b, window, neu1e.row(b), alpha);
+            }
+        }
+    }
+
+    // Average of the vectors of the context of words[sentence_pos] in neu1, returns the
+    // number of words of the context. The words must be filled up to sentence_pos + window.
+    int context(const SlidingWindow& words, long long sentence_pos, int window, float* neu1) {
+        const Kernels& k = kernels();
+        int dim = embedding_dim();
+        long long sentence_length = words.end;
+        std::fill_n(neu1, dim, 0.0f);
+        int cw = 0;
+        for (int i = 0; i < 2 * window + 1; i++) {
+            if (i == window) continue;
+            long long j = sentence_pos - window + i;
+            if (j < 0) continue;
+            if (j >= sentence_length) continue;
+            int context_word = words[j];
+            if (!hogwild) syn0_mutex[context_word].lock();
+            if (syn0_half.empty()) {
+                k.axpy(1, syn0.row(context_word), neu1, dim);
+            } else {
+                syn0_half.add_to(context_word, neu1);
+            }
+            if (!hogwild) syn0_mutex[context_word].unlock();
+            cw++;
+        }
+        if (cw) k.scale(1.0f / cw, neu1, dim);
+        return cw;
+    }
+
+    // Negative sampling for one target row
+    void output(int target, int label, const float* neu1, float* neu1e, float alpha) {
+        const Kernels& k = kernels();
+        int dim = embedding_dim();
+        if (!hogwild) syn1neg1_mutex[target].lock();
+        float* row = syn1neg1_half.empty() ? syn1neg1.row(target) : scratch_row();
+        if (!syn1neg1_half.empty()) syn1neg1_half.load(target, row);
+        float dot_product = k.dot(neu1, row, dim);
+        float error = label - sigmoid(dot_product);
+        //error *= sigmoid_derivative(dot_product);
+        // neu1e += syn1neg1[target] * error, syn1neg1[target] += neu1 * error * alpha
+        k.output_update(error, error * alpha, neu1, neu1e, row, dim);
+        if (!syn1neg1_half.empty()) syn1neg1_half.store(target, row);
+        if (!hogwild) syn1neg1_mutex[target].unlock();
+    }
+
+    void hierarchical_softmax(int word, const float* neu1, float* neu1e, float alpha) {
+        using namespace std;
+        if (syn1.empty()) return;
+        const Kernels& k = kernels();
+        int dim = embedding_dim();
+        span<const int> path = tree.path(word);
+        span<const char> code = tree.code(word);
+        for (int d = 0; d < (int)path.size(); d++) {
+            int node = path[d];
+            if (!hogwild) syn1_mutex[node].lock();
+            float dot_product = k.dot(neu1, syn1.row(node), dim);
+            float error = 1 - code[d] - sigmoid(dot_product);
+            k.output_update(error, error * alpha, neu1, neu1e, syn1.row(node), dim);
+            if (!hogwild) syn1_mutex[node].unlock();
+        }
+    }
+
+    // Applies neu1e to the context of words[sentence_pos]
+    void update_context(const SlidingWindow& words, long long sentence_pos, int window,
+                        const float* neu1e, float alpha) {
+        const Kernels& k = kernels();
+        int dim = embedding_dim();
+        long long sentence_length = words.end;
+        for (int i = 0; i < 2 * window + 1; i++) {
+            if (i == window) continue;
+            long long j = sentence_pos - window + i;
+            if (j < 0) continue;
+            if (j >= sentence_length) continue;
+            int context_word = words[j];
+            if (!hogwild) syn0_mutex[context_word].lock();
+            if (syn0_half.empty()) {
+                k.axpy(alpha, neu1e, syn0.row(context_word), dim);
+            } else {
+                float* row = scratch_row();
+                syn0_half.load(context_word, row);
+                k.axpy(alpha, neu1e, row, dim);
+                syn0_half.store(context_word, row);
+            }
+            if (!hogwild) syn0_mutex[context_word].unlock();
         }
     }
 
-    void save(std::ostream& os) const {
+    // Spreads the pages of the model over the NUMA nodes: interleaved, or with the rows cut in
+    // nb_threads blocks, each on the node of one thread, as if each thread had touched its block first
+    bool place(const Topology& topology, const std::string& policy, int nb_threads) {
+        bool ok = true;
+        auto place_rows = [&](const void* data, int rows, size_t row_bytes) {
+            if (rows == 0) return;
+            if (policy == "interleave") {
+                ok &= topology.interleave(data, rows * row_bytes);
+                return;
+            }
+            for (int t = 0; t < nb_threads; t++) {
+                long long first = (long long)rows * t / nb_threads;
+                long long last = (long long)rows * (t + 1) / nb_threads;
+                ok &= topology.bind(static_cast<const char*>(data) + first * row_bytes, (last - first) * row_bytes,
+                                    topology.node_of_thread(t));
+            }
+        };
+        for (Matrix<float>* m : {&syn0, &syn1neg1, &syn1}) {
+            place_rows(m->data, m->rows, m->stride * sizeof(float));
+        }
+        for (HalfMatrix* m : {&syn0_half, &syn1neg1_half}) {
+            place_rows(m->values.data, m->values.rows, m->values.stride * sizeof(uint16_t));
+        }
+        return ok;
+    }
+
+    void save(std::ostream& os, bool output_layer) const {
         save_number(os, (int)text.vocabulary.size());
-        for (const std::string& w : text.vocabulary) {
+        for (std::string_view w : text.vocabulary) {
             os << w << ' ';
         }
-        save_number(os, (int)syn0[0].size());
+        save_number(os, embedding_dim());
         int all_zeros = 0;
         float max_abs = 0;
-        for (int i = 0; i < (int)syn0.size(); i++) {
+        // The rows stored in 16 bits are converted one at a time
+        std::vector<float> row(embedding_dim());
+        for (int i = 0; i < (int)text.vocabulary.size(); i++) {
+            if (!syn0_half.empty()) syn0_half.load(i, row.data());
+            const float* values = syn0_half.empty() ? syn0.row(i) : row.data();
             bool all = true;
-            for (int j = 0; j < (int)syn0[0].size(); j++) {
-                if (syn0[i][j] != 0) all = false;
-                max_abs = std::max(max_abs, abs(syn0[i][j]));
-                save_number(os, syn0[i][j]);
+            for (int j = 0; j < embedding_dim(); j++) {
+                if (values[j] != 0) all = false;
+                max_abs = std::max(max_abs, abs(values[j]));
+                save_number(os, values[j]);
             }
             if (all) dbg(text.vocabulary[i]);
             all_zeros += all;
         }
         dbg(max_abs);
         dbg(all_zeros);
+        if (output_layer && syn1neg1_half.empty()) save_output_layer(os, text.cnt, syn1neg1);
+        if (output_layer && !syn1neg1_half.empty()) save_output_layer(os, text.cnt, syn1neg1_half);
+    }
+
+    // Everything needed to resume the training: what must not change, the progress, the state of
+    // each thread and of the scheduler, and the weights in fp32
+    void save_checkpoint(std::ostream& os, const Scheduler& scheduler, int iter) const {
+        using namespace std;
+        os << checkpoint_marker;
+        save_number(os, (int)text.vocabulary.size());
+        save_number(os, text.size());
+        save_number(os, embedding_dim());
+        save_number(os, (int)states.size());
+        save_number(os, scheduler.chunk);
+        save_number(os, iter);
+        save_number(os, syn1.rows);
+        save_number(os, words_read.load());
+        save_number(os, words_processed.load());
+        for (const Scheduler::Queue& q : scheduler.queues) save_number(os, q.range.load());
+        for (const WorkerState& state : states) state.save(os);
+        vector<float> row(embedding_dim());
+        auto save_rows = [&](const Matrix<float>& m, const HalfMatrix& half) {
+            for (int i = 0; i < (half.empty() ? m.rows : half.values.rows); i++) {
+                if (!half.empty()) half.load(i, row.data());
+                const float* values = half.empty() ? m.row(i) : row.data();
+                for (int j = 0; j < embedding_dim(); j++) save_number(os, values[j]);
+            }
+        };
+        save_rows(syn0, syn0_half);
+        save_rows(syn1neg1, syn1neg1_half);
+        save_rows(syn1, HalfMatrix());
+    }
+
+    // Before set_precision. Returns false if the checkpoint was made with another text or other options.
+    bool load_checkpoint(std::istream& is, Scheduler& scheduler, int iter, int window) {
+        using namespace std;
+        string marker(checkpoint_marker.size(), ' ');
+        is.read(marker.data(), marker.size());
+        if (marker != checkpoint_marker) return false;
+        if (load_number<int>(is) != (int)text.vocabulary.size() || load_number<long long>(is) != text.size() ||
+            load_number<int>(is) != embedding_dim() || load_number<int>(is) != (int)states.size() ||
+            load_number<long long>(is) != scheduler.chunk || load_number<int>(is) != iter ||
+            load_number<int>(is) != syn1.rows) {
+            return false;
+        }
+        words_read = load_number<long long>(is);
+        words_processed = load_number<long long>(is);
+        for (Scheduler::Queue& q : scheduler.queues) q.range = load_number<unsigned long long>(is);
+        for (WorkerState& state : states) {
+            state.load(is);
+            // The ring of the words must be the one the options give
+            if (!state.words.ring.empty() && state.words.ring.size() != std::bit_ceil((size_t)(2 * window + batch))) {
+                return false;
+            }
+        }
+        for (Matrix<float>* m : {&syn0, &syn1neg1, &syn1}) {
+            for (int i = 0; i < m->rows; i++) {
+                for (float& weight : (*m)[i]) weight = load_number<float>(is);
+            }
+        }
+        return true;
+    }
+
+    // Writes a checkpoint in the background: the threads are parked between two positions while
+    // the process forks, and the child writes its copy-on-write image of the model while the
+    // training goes on. The file is replaced only once complete. Returns how long the threads
+    // were stopped, in seconds.
+    double checkpoint(const std::string& filename, const Scheduler& scheduler, int iter) {
+        using namespace std;
+        // One checkpoint written at a time
+        wait_checkpoint();
+        auto start = chrono::steady_clock::now();
+        pause.stop();
+        pid_t pid = fork();
+        if (pid == 0) {
+            // Only this thread exists in the child, the others were parked outside of any lock
+            string tmp = filename + ".tmp";
+            ofstream os{tmp, ios::binary};
+            save_checkpoint(os, scheduler, iter);
+            os.close();
+            bool ok = os.good() && rename(tmp.c_str(), filename.c_str()) == 0;
+            _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        pause.resume();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (pid == -1) {
+            error("error while starting the process writing the checkpoint");
+        } else {
+            checkpoint_writer = pid;
+        }
+        return seconds;
+    }
+
+    // Waits for the process writing the last checkpoint
+    void wait_checkpoint() {
+        if (checkpoint_writer == 0) return;
+        int status;
+        if (waitpid(checkpoint_writer, &status, 0) != checkpoint_writer || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != EXIT_SUCCESS) {
+            error("error while writing the checkpoint");
+        }
+        checkpoint_writer = 0;
     }
 
     void load(std::istream& is) {
@@ -152,31 +601,60 @@ struct WordEmbedding {
         int vocabulary_size = vocabulary.size();
         assert(vocabulary_size == text.vocabulary.size());
         dbg(vocabulary_size);
-        int embedding_size = embeddings.size();
+        int embedding_size = embeddings.cols;
         dbg(embedding_size);
+        auto [counts, output_layer] = load_output_layer(is, vocabulary_size, embedding_size);
         init(embedding_size, vocabulary_size);
         syn0 = std::move(embeddings);
+        if (!output_layer.empty()) syn1neg1 = std::move(output_layer);
     }
-};
 
+    // Starts from a model whose words are the first words of the vocabulary
+    void extend(const Matrix<float>& base_syn0, const Matrix<float>& base_syn1neg1) {
+        for (int i = 0; i < base_syn0.size(); i++) {
+            std::ranges::copy(base_syn0[i], syn0[i].begin());
+            std::ranges::copy(base_syn1neg1[i], syn1neg1[i].begin());
+        }
+    }
+};
 
+// The tests include this file for WordEmbedding, without the program
+#ifndef WORD2VEC_NO_MAIN
 int main(int ac, char* av[]) {
     using namespace std;
     po::options_description desc("CBOW Word Embedding");
     desc.add_options()
         ("help", "produce help message")
         ("train", po::value<std::string>(), "Input file to train the model")
+        ("corpus-cache", po::value<std::string>(), "Cache file for the preprocessed training file, reused while the training file, min-count, stop and sample are unchanged")
         ("model", po::value<std::string>(), "Model file")
+        ("incremental", "Go on training the model given by --model on a new text, adding the new words that appear at least MIN-COUNT times")
+        ("save-output-layer", "Also save the word counts and the output layer in the output file, needed to train the model incrementally")
         ("output", po::value<std::string>(), "Output file to save the resulting word vectors")
         ("size", po::value<int>()->default_value(300), "Set size of word vectors; default is 300")
         ("window", po::value<int>()->default_value(5), "Set max skip length between words; default is 5")
         ("sample", po::value<float>()->default_value(1e-4), "Set threshold for occurrence of words. Those that appear with higher frequency in the training data will be randomly down-sampled; default is 1e-4, useful range is (0, 1e-5)")
-        ("negative", po::value<int>()->default_value(5), "Number of negative examples; default is 5, common values are 3 - 10 (0 = not used)")
+        ("negative", po::value<int>()->default_value(5), "Number of negative examples; default is 5, common values are 3 - 10 (0 = not used, only with --hs)")
+        ("hs", "Use hierarchical softmax, alone with --negative 0 or in addition to negative sampling")
         ("min-count", po::value<int>()->default_value(10), "This will discard words that appear less than MIN-COUNT times; default is 10")
         ("iter", po::value<int>()->default_value(15), "Run more training iterations (default 15)")
         ("alpha", po::value<float>()->default_value(0.001), "Set the starting learning rate; default is 0.001")
         ("thread", po::value<int>()->default_value(12), "Number of threads, default is 12")
-        ("stop", "Filter out stop words from text");
+        ("stop", "Filter out stop words from text")
+        ("hogwild", "Update the model without locks")
+        ("batch", po::value<int>()->default_value(1), "Number of consecutive words sharing the same negative examples, computed together as matrix products; default is 1")
+        ("stream", "Keep the text on disk in the corpus cache instead of memory, needs --corpus-cache")
+        ("syn0-precision", po::value<std::string>()->default_value("fp32"), "Storage of the word vectors during the training: fp32, bf16 or fp16, the computations being done in fp32; default is fp32")
+        ("syn1neg1-precision", po::value<std::string>()->default_value("fp32"), "Storage of the output layer during the training: fp32, bf16 or fp16; default is fp32")
+        ("stochastic-rounding", "Round the values stored in bf16 or fp16 stochastically instead of to the nearest")
+        ("pin", "Pin each thread to a core, the threads going to the NUMA nodes in turn")
+        ("numa", po::value<std::string>(), "Place the model on the NUMA nodes: interleave, or first-touch to put a block of rows and the thread's part of the text on the node of each thread (implies --pin)")
+        ("chunk", po::value<long long>()->default_value(1 << 16), "Number of words of the pieces of work shared between the threads, default is 65536")
+        ("buffer", po::value<long long>()->default_value(1 << 20), "Number of words read at once by each thread with --stream, default is 1048576")
+        ("seed", po::value<uint64_t>(), "Seed of the random numbers, to repeat a run; by default it comes from the clock and is printed at the end")
+        ("checkpoint", po::value<std::string>(), "File where the state of the training is saved regularly, in the background")
+        ("checkpoint-interval", po::value<double>()->default_value(600), "Seconds between two checkpoints, default is 600")
+        ("resume", "Resume the training from the file given by --checkpoint, with the same text and options");
     po::positional_options_description p;
     p.add("train", -1);
     po::variables_map vm;
@@ -190,18 +668,61 @@ int main(int ac, char* av[]) {
         cout << "You must specify the name of the training file\n";
         return EXIT_FAILURE;
     }
-    Text text{vm};
-    vector<pair<int, int>> slices;
-    int nb_threads = vm["thread"].as<int>();
-    int text_size = text.text.size();
-    int slice = (text_size + nb_threads - 1) / nb_threads;
-    for (int i = 0; i < nb_threads; i++) {
-        slices.emplace_back(i * slice, min(text_size, (i + 1) * slice));
+    if (vm.count("stream") && vm.count("corpus-cache") == 0) {
+        cout << "You must specify a corpus cache to stream the text from\n";
+        return EXIT_FAILURE;
     }
-    dbg(slices);
-    dbg(slice);
-    WordEmbedding res{vm["size"].as<int>(), text};
-    if (vm.count("model")) {
+    if (vm.count("incremental") && (vm.count("model") == 0 || vm.count("corpus-cache"))) {
+        cout << "You must specify the model to train incrementally, without corpus cache\n";
+        return EXIT_FAILURE;
+    }
+    if (vm.count("resume") && (vm.count("checkpoint") == 0 || vm.count("model"))) {
+        cout << "You must specify the checkpoint to resume from, without model\n";
+        return EXIT_FAILURE;
+    }
+    // The model to train incrementally is loaded before the text, so that its words keep their ids
+    Text base;
+    Matrix<float> base_syn0, base_syn1neg1;
+    if (vm.count("incremental")) {
+        string filename = vm["model"].as<string>();
+        ifstream is{filename, ios::binary};
+        if (!is.is_open()) {
+            error("error while opening model " + filename);
+            return EXIT_FAILURE;
+        }
+        tie(base.vocabulary, base_syn0) = load(is);
+        tie(base.cnt, base_syn1neg1) = load_output_layer(is, base_syn0.size(), base_syn0.cols);
+        if (is.bad()) {
+            error("error while reading model " + filename);
+            return EXIT_FAILURE;
+        }
+        if (base.cnt.empty()) {
+            cout << "The model must have been saved with --save-output-layer to be trained incrementally\n";
+            return EXIT_FAILURE;
+        }
+    }
+    // The training starts while the ids of the text are written, see Text::read
+    auto reading = chrono::steady_clock::now();
+    Text text{vm, vm.count("incremental") ? &base : nullptr};
+    int nb_threads = max(1, vm["thread"].as<int>());
+    Scheduler scheduler{text.size(), vm["chunk"].as<long long>(), vm["iter"].as<int>(), nb_threads};
+    dbg(scheduler.chunk);
+    int size = vm.count("incremental") ? base_syn0.cols : vm["size"].as<int>();
+    optional<Precision> syn0_precision = parse_precision(vm["syn0-precision"].as<string>());
+    optional<Precision> syn1neg1_precision = parse_precision(vm["syn1neg1-precision"].as<string>());
+    if (!syn0_precision || !syn1neg1_precision) {
+        cout << "The precisions must be fp32, bf16 or fp16\n";
+        return EXIT_FAILURE;
+    }
+    // Only a new model is created in 16 bits: the others are read or extended in fp32 and converted below
+    bool stochastic = vm.count("stochastic-rounding");
+    bool fresh = !vm.count("incremental") && !vm.count("model") && !vm.count("resume");
+    WordEmbedding res{size, text, fresh ? *syn0_precision : Precision::fp32,
+                      fresh ? *syn1neg1_precision : Precision::fp32, stochastic};
+    if (vm.count("incremental")) {
+        res.extend(base_syn0, base_syn1neg1);
+        dbg(base_syn0.size(), text.vocabulary.size());
+    } else if (vm.count("model")) {
         string filename = vm["model"].as<string>();
         ifstream is{filename, ios::binary};
         if (!is.is_open()) {
@@ -217,16 +738,142 @@ int main(int ac, char* av[]) {
     }
     float alpha = vm["alpha"].as<float>();
     int window = max(1, vm["window"].as<int>());
-    int negative = max(1, vm["negative"].as<int>());
+    int negative = max(vm.count("hs") ? 0 : 1, vm["negative"].as<int>());
+    if (vm.count("hs")) res.use_hierarchical_softmax();
     int iter = vm["iter"].as<int>();
+    long long buffer = vm["buffer"].as<long long>();
+    res.hogwild = vm.count("hogwild");
+    res.batch = max(1, vm["batch"].as<int>());
+    uint64_t seed = vm.count("seed") ? vm["seed"].as<uint64_t>() : chrono::system_clock::now().time_since_epoch().count();
+    res.start_workers(nb_threads, seed);
+    if (vm.count("resume")) {
+        string filename = vm["checkpoint"].as<string>();
+        ifstream is{filename, ios::binary};
+        if (!is.is_open()) {
+            error("error while opening checkpoint " + filename);
+            return EXIT_FAILURE;
+        }
+        if (!res.load_checkpoint(is, scheduler, iter, window)) {
+            cout << "The checkpoint was made with another text or other options\n";
+            return EXIT_FAILURE;
+        }
+        if (!is) {
+            error("error while reading checkpoint " + filename);
+            return EXIT_FAILURE;
+        }
+        cerr << "resuming after " << res.words_read << " words" << endl;
+    }
+    res.set_precision(*syn0_precision, *syn1neg1_precision, stochastic);
+    Topology topology;
+    string numa = vm.count("numa") ? vm["numa"].as<string>() : "";
+    if (numa != "" && numa != "interleave" && numa != "first-touch") {
+        cout << "--numa must be interleave or first-touch\n";
+        return EXIT_FAILURE;
+    }
+    bool pin = vm.count("pin") || numa == "first-touch";
+    if (numa != "") {
+        if (!res.place(topology, numa, nb_threads)) error("error while placing the model on the NUMA nodes");
+        // The chunks each thread starts with go to its node, the text being only read
+        for (int t = 0; numa == "first-touch" && text.stream.empty() && t < nb_threads; t++) {
+            const Scheduler::Queue& q = scheduler.queues[t];
+            long long first = min(text.size(), q.first_chunk * scheduler.chunk);
+            long long last = min(text.size(), (q.first_chunk + q.nb_chunks) * scheduler.chunk);
+            if (!topology.bind(text.ids().data() + first, (last - first) * sizeof(int), topology.node_of_thread(t))) {
+                error("error while placing the text on the NUMA nodes");
+                break;
+            }
+        }
+    }
+    if (pin || numa != "") {
+        cerr << topology.size() << " NUMA nodes";
+        if (numa != "") {
+            cerr << ", pages of syn0 by node:";
+            vector<long long> pages = res.syn0_half.empty() ?
+                topology.pages_per_node(res.syn0.data, res.syn0.bytes()) :
+                topology.pages_per_node(res.syn0_half.values.data, res.syn0_half.values.bytes());
+            for (long long p : pages) cerr << ' ' << p;
+        }
+        cerr << endl;
+        for (int node = 0; pin && node < topology.size(); node++) {
+            cerr << "node " << topology.ids[node] << ": cpus";
+            for (int t = node; t < nb_threads; t += topology.size()) cerr << ' ' << topology.cpu_of_thread(t);
+            cerr << endl;
+        }
+    }
+    auto start = chrono::steady_clock::now();
+    long long first_words = res.words_processed;
+    vector<WorkerStats> stats(nb_threads);
     vector<thread> workers;
     for (int i = 0; i < nb_threads; i++) {
-        workers.emplace_back([&, i] { res.learn(slices[i], alpha, window, negative, iter); });
+        workers.emplace_back([&, i] {
+            if (pin && !Topology::pin(topology.cpu_of_thread(i))) {
+                cerr << "could not pin thread " << i << " to cpu " << topology.cpu_of_thread(i) << endl;
+            }
+            res.learn(scheduler, i, alpha, window, negative, iter, buffer, start, stats[i]);
+        });
     }
     print_id = workers[0].get_id();
+    // Checkpoints until the workers are done
+    mutex done_mutex;
+    condition_variable done_cv;
+    bool done = false;
+    vector<double> stalls;
+    thread checkpointer;
+    if (vm.count("checkpoint")) {
+        checkpointer = thread([&] {
+            string filename = vm["checkpoint"].as<string>();
+            auto interval = chrono::duration<double>(max(0.001, vm["checkpoint-interval"].as<double>()));
+            unique_lock lock{done_mutex};
+            while (!done_cv.wait_for(lock, interval, [&] { return done; })) {
+                stalls.emplace_back(res.checkpoint(filename, scheduler, iter));
+            }
+        });
+    }
     for (auto& worker : workers) {
         worker.join();
     }
+    {
+        lock_guard lock{done_mutex};
+        done = true;
+    }
+    done_cv.notify_all();
+    if (checkpointer.joinable()) checkpointer.join();
+    res.wait_checkpoint();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    long long words = res.words_processed - first_words;
+    cerr << words << " words in " << seconds << "s, "
+         << words / seconds << " words/s with " << nb_threads << " threads"
+         << (res.hogwild ? " (hogwild)" : " (locks)") << ", seed " << seed << endl;
+    // Tail of the chunk times, spread of the end of the threads and time they spent without work
+    vector<float> chunk_seconds;
+    long long stolen = 0;
+    double busy = 0, first_finished = seconds, last_finished = 0, first_update = seconds;
+    for (const WorkerStats& s : stats) {
+        if (s.first_update >= 0) first_update = min(first_update, s.first_update);
+        chunk_seconds.insert(chunk_seconds.end(), s.chunk_seconds.begin(), s.chunk_seconds.end());
+        stolen += s.stolen;
+        busy += s.busy;
+        first_finished = min(first_finished, s.finished);
+        last_finished = max(last_finished, s.finished);
+    }
+    if (!stalls.empty()) {
+        cerr << stalls.size() << " checkpoints, threads stopped " << 1000 * *max_element(stalls.begin(), stalls.end())
+             << "ms at most" << endl;
+    }
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) cerr << "peak memory " << usage.ru_maxrss / 1024 << "MB" << endl;
+    if (!chunk_seconds.empty()) {
+        sort(begin(chunk_seconds), end(chunk_seconds));
+        auto percentile = [&](double p) { return 1000 * chunk_seconds[(size_t)(p * (chunk_seconds.size() - 1))]; };
+        cerr << chunk_seconds.size() << " chunks, " << stolen << " stolen, chunk time p50 " << percentile(0.5)
+             << "ms p99 " << percentile(0.99) << "ms max " << percentile(1) << "ms" << endl;
+        cerr << "threads finished between " << first_finished << "s and " << last_finished << "s, idle "
+             << 100 * (1 - busy / (seconds * nb_threads)) << "% of the time" << endl;
+    }
+    cerr << "first update " << chrono::duration<double>(start - reading).count() + first_update
+         << "s after the text started to be read";
+    if (text.encoder) cerr << ", all the ids encoded after " << chrono::duration<double>(text.encoded() - reading).count() << "s";
+    cerr << endl;
     if (vm.count("output")) {
         string filename = vm["output"].as<string>();
         ofstream os{filename, ios::binary};
@@ -234,13 +881,14 @@ int main(int ac, char* av[]) {
             error("error while opening file " + filename);
             return EXIT_FAILURE;
         }
-        res.save(os);
+        res.save(os, vm.count("save-output-layer"));
         if (os.bad()) {
             error("error while saving the model in " + filename);
             return EXIT_FAILURE;
         }
     } else {
-        res.save(cout);
+        res.save(cout, vm.count("save-output-layer"));
     }
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+#endif
@@ -11,16 +11,43 @@
 #include <random>
 #include <memory>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
 #include "util.hpp"
 #include "text.hpp"
+#include "token_reader.hpp"
+#include "kernels.hpp"
+#include "sparse_rows.hpp"
+#include "huffman.hpp"
+#include "rng.hpp"
+#include "sliding_window.hpp"
+#include "averaging.hpp"
+#include "scheduler.hpp"
 
 namespace po = boost::program_options;
 
-using gradient = std::array<std::vector<weighted_vector<float>>, 2>;
+// Gradients of syn0, syn1neg1 and syn1, on the rows touched by a slice
+using gradient = std::array<SparseRows, 3>;
 
 struct WordEmbedding {
-    std::vector<std::vector<float>> syn0;
-    std::vector<std::vector<float>> syn1neg1;
+    std::atomic<long long> words_processed = 0;
+    // The random numbers of a slice depend only on the seed, the slice and the iteration
+    uint64_t seed = 0;
+    Matrix<float> syn0;
+    Matrix<float> syn1neg1;
+    // Hierarchical softmax: the internal nodes of the tree, empty when it is not used
+    HuffmanTree tree;
+    Matrix<float> syn1;
+    // With --staleness, learn reads this copy of syn0, syn1neg1 and syn1 while the updater thread
+    // writes the model. It is refreshed between the batches, from the rows updated since.
+    std::array<Matrix<float>, 3> snapshot;
+    std::array<std::vector<int>, 3> updated;
+    // Loss of the predictions made since the last reset, and the number of positions they were made at
+    std::atomic<double> loss = 0;
+    std::atomic<long long> positions = 0;
     std::shared_ptr<Text> text;
 
     WordEmbedding(int size, std::shared_ptr<Text> text) : text(text) {
@@ -29,122 +56,205 @@ struct WordEmbedding {
 
     void init(int size, int vocab_size) {
         using namespace std;
-        syn0.resize(vocab_size, vector<float>(size));
-        syn1neg1.resize(vocab_size, vector<float>(size));
+        syn0 = Matrix<float>(vocab_size, size);
+        syn1neg1 = Matrix<float>(vocab_size, size);
         default_random_engine generator;
         uniform_real_distribution<float> distribution(-0.5, 0.5);
-        for (auto& hidden2output : syn1neg1) {
-            for (float& weight : hidden2output) {
+        for (int i = 0; i < vocab_size; i++) {
+            for (float& weight : syn1neg1[i]) {
                 weight = distribution(generator);
             }
         }
     }
 
     int embedding_dim() const {
-        return syn0[0].size();
+        return syn0.cols;
     }
 
-    gradient empty_gradient() const {
-        std::vector<weighted_vector<float>> empty(text->vocabulary.size());
-        return {empty, empty};
+    void use_hierarchical_softmax() {
+        tree = HuffmanTree(text->cnt);
+        syn1 = Matrix<float>(tree.size(), embedding_dim());
+        // Random as syn1neg1: syn0 starts at 0, so with both at 0 no gradient would ever flow
+        std::default_random_engine generator;
+        std::uniform_real_distribution<float> distribution(-0.5, 0.5);
+        for (int i = 0; i < syn1.rows; i++) {
+            for (float& weight : syn1[i]) {
+                weight = distribution(generator);
+            }
+        }
+    }
+
+    Matrix<float>& weights(int k) {
+        return k == 0 ? syn0 : k == 1 ? syn1neg1 : syn1;
+    }
+
+    // Rows read by learn
+    const Matrix<float>& current(int k) {
+        return snapshot[k].empty() ? weights(k) : snapshot[k];
+    }
+
+    // Copies the whole model to the snapshot. No update may run during the call.
+    void take_snapshot() {
+        for (int k = 0; k < 3; k++) {
+            snapshot[k] = weights(k);
+            updated[k].clear();
+        }
+    }
+
+    // Copies the rows updated since the last refresh to the snapshot. No update may run during the call.
+    void refresh_snapshot() {
+        using namespace std;
+        for (int k = 0; k < 3; k++) {
+            Matrix<float>& w = weights(k);
+            vector<int>& rows = updated[k];
+            sort(begin(rows), end(rows));
+            rows.erase(unique(begin(rows), end(rows)), end(rows));
+            for_each(execution::par_unseq, begin(rows), end(rows), [&](int r) {
+                copy_n(w.row(r), w.cols, snapshot[k].row(r));
+            });
+            rows.clear();
+        }
     }
 
-    gradient learn(const std::pair<int, int>& slice, float starting_alpha,
+    gradient learn(const std::pair<long long, long long>& slice, float starting_alpha,
                    int window, int negative, int iter, int max_iter) {
         using namespace std;
-        const int vocab_size = text->vocabulary.size();
-        vector<weighted_vector<float>> syn0_grad(vocab_size);
-        vector<weighted_vector<float>> syn1neg1_grad(vocab_size);
-        float alpha = starting_alpha * (1 - (float)iter / max_iter);
-        default_random_engine generator(chrono::system_clock::now().time_since_epoch().count());
-        uniform_real_distribution<float> distribution(0, 1);
-        vector<int> sentence;
-        // Subsampling of frequent words
-        for (int i = slice.first; i < slice.second; i++) {
-            if (text->subsampling.size() &&
-                text->subsampling[text->text[i]] < distribution(generator)) continue;
-            sentence.emplace_back(text->text[i]);
+        const int dim = embedding_dim();
+        // Accumulators of the thread, reused by all its slices
+        thread_local array<SparseAccumulator, 3> grad;
+        for (int c = 0; c < 3; c++) {
+            int rows = weights(c).rows;
+            if ((int)grad[c].slot.size() != rows || grad[c].dim != dim) grad[c] = SparseAccumulator(rows, dim);
         }
-        int sentence_length = sentence.size();
-        for (int sentence_pos = 0; sentence_pos < sentence_length; sentence_pos++) {
-            int word = sentence[sentence_pos];
-            // This vector will hold the *average* of all of the context word vectors.
-            // This is the output of the hidden layer.
-            weighted_vector<float> neu1;
-            // Holds the gradient for updating the hidden layer weights.
-            // This same gradient update is applied to all context word vectors.
-            weighted_vector<float> neu1e;
+        float alpha = starting_alpha * (1 - (float)iter / max_iter);
+        thread_local Sampler sampler;
+        sampler.seed(seed, (uint64_t)slice.first * max_iter + iter);
+        // One reader and its buffer per thread for the whole training, with --stream
+        thread_local TokenReader reader{*text, slice.second - slice.first};
+        // Subsampling of frequent words, on the fly
+        thread_local SlidingWindow words;
+        words.reserve(2 * window + 1);
+        words.start(reader.read(slice.first, slice.second));
+        const Kernels& k = Kernels::get();
+        const Matrix<float>& syn0 = current(0);
+        const Matrix<float>& syn1neg1 = current(1);
+        const Matrix<float>& syn1 = current(2);
+        double slice_loss = 0;
+        long long slice_positions = 0;
+        // This vector will hold the *average* of all of the context word vectors.
+        // This is the output of the hidden layer.
+        weighted_vector<float> neu1{vector<float>(dim), 0};
+        // Holds the gradient for updating the hidden layer weights.
+        // This same gradient update is applied to all context word vectors.
+        weighted_vector<float> neu1e{vector<float>(dim), 0};
+        for (long long sentence_pos = 0;
+             words.fill(sentence_pos + window, sampler, text->subsampling) > sentence_pos; sentence_pos++) {
+            long long sentence_length = words.end;
+            int word = words[sentence_pos];
+            // Both vectors are reused from one position to the next, without allocating
+            neu1.second = 0;
+            neu1e.second = 0;
             for (int i = 0; i < 2 * window + 1; i++) {
                 if (i == window) continue;
-                int j = sentence_pos - window + i;
+                long long j = sentence_pos - window + i;
                 if (j < 0) continue;
                 if (j >= sentence_length) continue;
-                int context_word = sentence[j];
+                int context_word = words[j];
                 neu1 += syn0[context_word];
             }
             [[unlikely]] if (neu1.second == 0) continue;
-            neu1 = normalize(neu1);
-            for (int sample = 0; sample < negative + 1; sample++) {
+            normalize_in_place(neu1);
+            if (!syn1.empty()) {
+                span<const int> path = tree.path(word);
+                span<const char> code = tree.code(word);
+                for (int d = 0; d < (int)path.size(); d++) {
+                    int node = path[d];
+                    float dot_product = k.dot(neu1.first.data(), syn1.row(node), dim);
+                    float error = 1 - code[d] - sigmoid(dot_product);
+                    slice_loss -= log(max(1e-7f, 1 - abs(error)));
+                    add_scaled(neu1e, syn1[node], error);
+                    k.axpy(error * alpha, neu1.first.data(), grad[2].add(node, neu1.second), dim);
+                }
+            }
+            for (int sample = 0; negative > 0 && sample < negative + 1; sample++) {
                 int target, label;
                 if (sample == 0) {
                     target = word;
                     label = 1;
                 } else {
-                    uniform_int_distribution<int> negative_sample(0, (int)text->unigram_table.size() - 1);
                     do {
-                        target = text->unigram_table[negative_sample(generator)];
+                        target = sampler.negative(text->unigram);
                     } while (target == word);
                     label = 0;
                 }
-                float dot_product = inner_product(begin(neu1.first), end(neu1.first),
-                                                  begin(syn1neg1[target]), static_cast<float>(0));
+                float dot_product = k.dot(neu1.first.data(), syn1neg1.row(target), dim);
                 float error = label - sigmoid(dot_product);
+                slice_loss -= log(max(1e-7f, 1 - abs(error)));
 //                    error *= sigmoid_derivative(dot_product);
-                neu1e += syn1neg1[target] * error;
-                syn1neg1_grad[target] += neu1 * error * alpha;
+                add_scaled(neu1e, syn1neg1[target], error);
+                k.axpy(error * alpha, neu1.first.data(), grad[1].add(target, neu1.second), dim);
             }
+            slice_positions++;
             for (int i = 0; i < 2 * window + 1; i++) {
                 if (i == window) continue;
-                int j = sentence_pos - window + i;
+                long long j = sentence_pos - window + i;
                 if (j < 0) continue;
                 if (j >= sentence_length) continue;
-                int context_word = sentence[j];
-                syn0_grad[context_word] += neu1e * alpha;
+                int context_word = words[j];
+                k.axpy(alpha, neu1e.first.data(), grad[0].add(context_word, neu1e.second), dim);
             }
         }
-        return {std::move(syn0_grad), std::move(syn1neg1_grad)};
+        words_processed += words.end;
+        loss += slice_loss;
+        positions += slice_positions;
+        return {grad[0].finish(), grad[1].finish(), grad[2].finish()};
     }
 
-    static gradient combine(const gradient& m1, const gradient& m2) {
-        gradient res = m1;
-        for (int k = 0; k < 2; k++) {
-            for (int i = 0; i < res[k].size(); i++) {
-                res[k][i] += m2[k][i];
+    // Sum of the gradients of a batch, merged two by two in parallel, in log2(n) rounds.
+    // The sum is left in gradients[0].
+    static void reduce(std::vector<gradient>& gradients) {
+        using namespace std;
+        vector<size_t> firsts;
+        for (size_t step = 1; step < gradients.size(); step *= 2) {
+            firsts.clear();
+            for (size_t i = 0; i + step < gradients.size(); i += 2 * step) {
+                firsts.emplace_back(i);
             }
+            for_each(execution::par, begin(firsts), end(firsts), [&](size_t i) {
+                for (int k = 0; k < (int)gradients[i].size(); k++) {
+                    gradients[i][k] = SparseRows::merge(gradients[i][k], gradients[i + step][k]);
+                }
+            });
         }
-        return res;
     }
 
-    void update(gradient& m) {
-        for (int i = 0; i < (int)syn0.size(); i++) {
-            syn0[i] += normalize(m[0][i]);
-        }
-        for (int i = 0; i < (int)syn1neg1.size(); i++) {
-            syn1neg1[i] += normalize(m[1][i]);
+    // Adds the average of the gradient of each touched row to the row
+    void update(const gradient& m) {
+        using namespace std;
+        const Kernels& k = Kernels::get();
+        for (int c = 0; c < (int)m.size(); c++) {
+            Matrix<float>& w = weights(c);
+            const SparseRows& g = m[c];
+            vector<int> rows(g.ids.size());
+            iota(begin(rows), end(rows), 0);
+            for_each(execution::par_unseq, begin(rows), end(rows), [&](int r) {
+                k.axpy(1.0f / g.weights[r], g[r].data(), w.row(g.ids[r]), w.cols);
+            });
+            if (!snapshot[c].empty()) updated[c].insert(updated[c].end(), g.ids.begin(), g.ids.end());
         }
     }
 
-    void save(std::ostream& os) const {
+    void save(std::ostream& os, bool output_layer) const {
         save_number(os, (int)text->vocabulary.size());
-        for (const std::string& w : text->vocabulary) {
+        for (std::string_view w : text->vocabulary) {
             os << w << ' ';
         }
-        save_number(os, (int)syn0[0].size());
+        save_number(os, embedding_dim());
         int all_zeros = 0;
         float max_abs = 0;
         for (int i = 0; i < (int)syn0.size(); i++) {
             bool all = true;
-            for (int j = 0; j < (int)syn0[0].size(); j++) {
+            for (int j = 0; j < embedding_dim(); j++) {
                 if (syn0[i][j] != 0) all = false;
                 max_abs = std::max(max_abs, abs(syn0[i][j]));
                 save_number(os, syn0[i][j]);
@@ -153,6 +263,7 @@ struct WordEmbedding {
         }
         dbg(max_abs);
         dbg(all_zeros);
+        if (output_layer) save_output_layer(os, text->cnt, syn1neg1);
     }
 
     void load(std::istream& is) {
@@ -160,10 +271,20 @@ struct WordEmbedding {
         int vocabulary_size = vocabulary.size();
         assert(vocabulary_size == text->vocabulary.size());
         dbg(vocabulary_size);
-        int embedding_size = embeddings.size();
+        int embedding_size = embeddings.cols;
         dbg(embedding_size);
+        auto [counts, output_layer] = load_output_layer(is, vocabulary_size, embedding_size);
         init(embedding_size, vocabulary_size);
         syn0 = std::move(embeddings);
+        if (!output_layer.empty()) syn1neg1 = std::move(output_layer);
+    }
+
+    // Starts from a model whose words are the first words of the vocabulary
+    void extend(const Matrix<float>& base_syn0, const Matrix<float>& base_syn1neg1) {
+        for (int i = 0; i < base_syn0.size(); i++) {
+            std::ranges::copy(base_syn0[i], syn0[i].begin());
+            std::ranges::copy(base_syn1neg1[i], syn1neg1[i].begin());
+        }
     }
 };
 
@@ -174,18 +295,29 @@ int main(int ac, char* av[]) {
     desc.add_options()
         ("help", "produce help message")
         ("train", po::value<std::string>(), "Input file to train the model")
+        ("corpus-cache", po::value<std::string>(), "Cache file for the preprocessed training file, reused while the training file, min-count, stop and sample are unchanged")
         ("model", po::value<std::string>(), "Model file")
+        ("incremental", "Go on training the model given by --model on a new text, adding the new words that appear at least MIN-COUNT times")
+        ("save-output-layer", "Also save the word counts and the output layer in the output file, needed to train the model incrementally")
         ("output", po::value<std::string>(), "Output file to save the resulting word vectors")
         ("size", po::value<int>()->default_value(300), "Set size of word vectors; default is 300")
         ("window", po::value<int>()->default_value(5), "Set max skip length between words; default is 5")
         ("sample", po::value<float>()->default_value(1e-4), "Set threshold for occurrence of words. Those that appear with higher frequency in the training data will be randomly down-sampled; default is 1e-4, useful range is (0, 1e-5)")
-        ("negative", po::value<int>()->default_value(5), "Number of negative examples; default is 5, common values are 3 - 10 (0 = not used)")
+        ("negative", po::value<int>()->default_value(5), "Number of negative examples; default is 5, common values are 3 - 10 (0 = not used, only with --hs)")
+        ("hs", "Use hierarchical softmax, alone with --negative 0 or in addition to negative sampling")
         ("min-count", po::value<int>()->default_value(10), "This will discard words that appear less than MIN-COUNT times; default is 10")
         ("iter", po::value<int>()->default_value(15), "Run more training iterations (default 15)")
         ("alpha", po::value<float>()->default_value(0.5), "Set the starting learning rate; default is 0.5")
         ("thread", po::value<int>()->default_value(60), "Number of threads, default is 60")
         ("work", po::value<int>()->default_value(40000), "Work load by thread, default is 40000")
-        ("stop", "Filter out stop words from text");
+        ("seed", po::value<uint64_t>(), "Seed of the random numbers, to repeat a run; by default it comes from the clock and is printed at the end")
+        ("staleness", po::value<int>()->default_value(0), "Let a batch be computed while the gradients of up to STALENESS previous batches are still being applied; default is 0, each batch sees all the previous updates")
+        ("stop", "Filter out stop words from text")
+        ("stream", "Keep the text on disk in the corpus cache instead of memory, needs --corpus-cache")
+        ("world", po::value<int>()->default_value(1), "Number of processes training together, each on its share of the slices; default is 1")
+        ("rank", po::value<int>()->default_value(0), "Number of this process, from 0 to WORLD - 1")
+        ("server", po::value<std::string>(), "Address where process 0 waits for the others, host:port or unix:path")
+        ("sync-interval", po::value<int>()->default_value(16), "Number of batches between two averagings of the model between the processes; default is 16");
     po::positional_options_description p;
     p.add("train", -1);
     po::variables_map vm;
@@ -199,21 +331,62 @@ int main(int ac, char* av[]) {
         cout << "You must specify the name of the training file\n";
         return EXIT_FAILURE;
     }
-    Text text{vm};
-    vector<pair<int, int>> slices;
-    int nb_threads = vm["thread"].as<int>();
-    int slice = vm["work"].as<int>();
-    int text_size = text.text.size();
-    if (slice == -1) slice = (text_size + nb_threads - 1) / nb_threads;
-    for (int i = 0; i < text_size; i += slice) {
-        slices.emplace_back(i, min(text_size, i + slice));
+    if (vm.count("stream") && vm.count("corpus-cache") == 0) {
+        cout << "You must specify a corpus cache to stream the text from\n";
+        return EXIT_FAILURE;
     }
-    int nb_slices = slices.size();
+    if (vm.count("incremental") && (vm.count("model") == 0 || vm.count("corpus-cache"))) {
+        cout << "You must specify the model to train incrementally, without corpus cache\n";
+        return EXIT_FAILURE;
+    }
+    int world = max(1, vm["world"].as<int>());
+    int rank = vm["rank"].as<int>();
+    if (rank < 0 || rank >= world || (world > 1 && vm.count("server") == 0)) {
+        cout << "The rank must be between 0 and WORLD - 1, and several processes need a server address\n";
+        return EXIT_FAILURE;
+    }
+    // The model to train incrementally is loaded before the text, so that its words keep their ids
+    Text base;
+    Matrix<float> base_syn0, base_syn1neg1;
+    if (vm.count("incremental")) {
+        string filename = vm["model"].as<string>();
+        ifstream is{filename, ios::binary};
+        if (!is.is_open()) {
+            error("error while opening model " + filename);
+            return EXIT_FAILURE;
+        }
+        tie(base.vocabulary, base_syn0) = load(is);
+        tie(base.cnt, base_syn1neg1) = load_output_layer(is, base_syn0.size(), base_syn0.cols);
+        if (is.bad()) {
+            error("error while reading model " + filename);
+            return EXIT_FAILURE;
+        }
+        if (base.cnt.empty()) {
+            cout << "The model must have been saved with --save-output-layer to be trained incrementally\n";
+            return EXIT_FAILURE;
+        }
+    }
+    // Shared with the model, and never copied: its ids may still be written, see Text::read
+    auto shared_text = make_shared<Text>(vm, vm.count("incremental") ? &base : nullptr);
+    Text& text = *shared_text;
+    int nb_threads = vm["thread"].as<int>();
+    long long slice = vm["work"].as<int>();
+    long long text_size = text.size();
+    if (slice == -1) slice = max(1LL, (text_size + nb_threads - 1) / nb_threads);
+    // Every process reads the whole text, so that they all have the same vocabulary, and trains
+    // on one slice out of `world`
+    long long total_slices = (text_size + slice - 1) / slice;
+    vector<pair<long long, long long>> slices = make_slices(text_size, slice, world, rank);
+    long long nb_slices = slices.size();
     dbg(slice);
 //    dbg(slices);
     dbg(nb_slices);
-    WordEmbedding res{vm["size"].as<int>(), make_shared<Text>(text)};
-    if (vm.count("model")) {
+    int size = vm.count("incremental") ? base_syn0.cols : vm["size"].as<int>();
+    WordEmbedding res{size, shared_text};
+    if (vm.count("incremental")) {
+        res.extend(base_syn0, base_syn1neg1);
+        dbg(base_syn0.size(), text.vocabulary.size());
+    } else if (vm.count("model")) {
         string filename = vm["model"].as<string>();
         ifstream is{filename, ios::binary};
         if (!is.is_open()) {
@@ -229,26 +402,140 @@ int main(int ac, char* av[]) {
     }
     float alpha = vm["alpha"].as<float>();
     int window = max(1, vm["window"].as<int>());
-    int negative = max(1, vm["negative"].as<int>());
+    int negative = max(vm.count("hs") ? 0 : 1, vm["negative"].as<int>());
+    if (vm.count("hs")) res.use_hierarchical_softmax();
     int iter = vm["iter"].as<int>();
-    default_random_engine engine(chrono::system_clock::now().time_since_epoch().count());
-    int nb_batches = (slices.size() + nb_threads - 1) / nb_threads;
+    res.seed = vm.count("seed") ? vm["seed"].as<uint64_t>() : chrono::system_clock::now().time_since_epoch().count();
+    default_random_engine engine(res.seed);
+    int staleness = max(0, vm["staleness"].as<int>());
+    TokenReader prefetcher{text, 0};
+    long long nb_batches = (nb_slices + nb_threads - 1) / nb_threads;
     dbg(nb_batches);
-    for (int i = 0; i < iter; i++) {
+    // The processes average their models in the background. They all make the same number of
+    // rounds, spread over their own batches, and a last one once they are done.
+    ModelAverager averager;
+    if (world > 1 && !averager.connect(vm["server"].as<string>(), rank, world, {&res.syn0, &res.syn1neg1, &res.syn1})) {
+        error("error while connecting the processes");
+        return EXIT_FAILURE;
+    }
+    long long total_batches = iter * nb_batches;
+    long long nb_rounds = world > 1 ? iter * ((total_slices / world + nb_threads - 1) / nb_threads) / max(1, vm["sync-interval"].as<int>()) : 0;
+    long long next_round = 1;
+    bool failed = false;
+    // With --staleness, the gradients of the batches are reduced and applied by an updater
+    // thread, while the next batches are computed from the snapshot of the model. The snapshot
+    // is refreshed every staleness + 1 batches, once the batches before have been applied, so
+    // that a batch misses the updates of at most `staleness` batches and a seed gives one model.
+    mutex pipeline_mutex;
+    condition_variable pipeline_cv;
+    deque<vector<gradient>> pending;
+    long long applied = 0;
+    bool done = false;
+    thread updater;
+    if (staleness > 0) {
+        res.take_snapshot();
+        updater = thread([&] {
+            unique_lock lock{pipeline_mutex};
+            while (true) {
+                pipeline_cv.wait(lock, [&] { return !pending.empty() || done; });
+                if (pending.empty()) return;
+                vector<gradient> gradients = std::move(pending.front());
+                pending.pop_front();
+                lock.unlock();
+                WordEmbedding::reduce(gradients);
+                res.update(gradients[0]);
+                lock.lock();
+                applied++;
+                pipeline_cv.notify_all();
+            }
+        });
+    }
+    // Once the updates of the batches before `batch` are applied, applies the average of the
+    // last round if it is done or a new round is due, and starts the new round
+    auto average = [&](long long batch) {
+        bool due = next_round <= nb_rounds && batch * nb_rounds >= next_round * total_batches;
+        if (!due && !(averager.pending() && averager.done())) return true;
+        if (staleness > 0) {
+            unique_lock lock{pipeline_mutex};
+            pipeline_cv.wait(lock, [&] { return applied >= batch; });
+        }
+        if (averager.pending()) {
+            if (!averager.finish()) return false;
+            // The average changed every row
+            if (staleness > 0) res.take_snapshot();
+        }
+        if (due) {
+            averager.start(res.words_processed);
+            next_round++;
+        }
+        return true;
+    };
+    auto start = chrono::steady_clock::now();
+    long long batch = 0;
+    for (int i = 0; i < iter && !failed; i++) {
         shuffle(begin(slices), end(slices), engine);
-        for (int j = 0; j < nb_slices; j += nb_threads) {
+        res.loss = 0;
+        res.positions = 0;
+        for (long long j = 0; j < nb_slices; j += nb_threads, batch++) {
             auto batch_start = begin(slices) + j;
             auto batch_end = begin(slices) + min(j + nb_threads, nb_slices);
-            gradient m = transform_reduce(execution::par_unseq, batch_start, batch_end,
-                                          res.empty_gradient(),
-                                          WordEmbedding::combine,
-                                          [&](const pair<int, int>& slice) {
-                                              return res.learn(slice, alpha, window, negative, i, iter);
-                                          });
-            res.update(m);
+            // Read ahead the slices of the next batch
+            for (auto it = batch_end; it != begin(slices) + min(j + 2LL * nb_threads, nb_slices); ++it) {
+                prefetcher.prefetch(it->first, it->second);
+            }
+            if (staleness > 0 && batch % (staleness + 1) == 0) {
+                unique_lock lock{pipeline_mutex};
+                pipeline_cv.wait(lock, [&] { return applied >= batch; });
+                res.refresh_snapshot();
+            }
+            vector<gradient> gradients(batch_end - batch_start);
+            vector<size_t> members(gradients.size());
+            iota(begin(members), end(members), 0);
+            for_each(execution::par, begin(members), end(members), [&](size_t m) {
+                gradients[m] = res.learn(batch_start[m], alpha, window, negative, i, iter);
+            });
+            if (staleness > 0) {
+                lock_guard lock{pipeline_mutex};
+                pending.emplace_back(std::move(gradients));
+                pipeline_cv.notify_all();
+            } else {
+                WordEmbedding::reduce(gradients);
+                res.update(gradients[0]);
+            }
+            if (world > 1 && !average(batch + 1)) {
+                failed = true;
+                break;
+            }
         }
         dbg(i);
     }
+    if (staleness > 0) {
+        {
+            lock_guard lock{pipeline_mutex};
+            done = true;
+        }
+        pipeline_cv.notify_all();
+        updater.join();
+    }
+    if (world > 1 && !failed) {
+        if (averager.pending()) failed = !averager.finish();
+        averager.start(res.words_processed);
+        failed = failed || !averager.finish(true);
+    }
+    if (failed) {
+        error("error while averaging the model with the other processes");
+        return EXIT_FAILURE;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cerr << res.words_processed << " words in " << seconds << "s, "
+         << res.words_processed / seconds << " words/s with " << nb_threads << " threads"
+         << " (staleness " << staleness << "), loss " << res.loss / max(1LL, res.positions.load())
+         << " by word on the last pass, seed " << res.seed << endl;
+    if (world > 1) {
+        cerr << averager.total_words << " words in " << seconds << "s, " << averager.total_words / seconds
+             << " words/s with " << world << " processes, " << averager.rounds << " averagings taking "
+             << averager.seconds << "s in the background" << endl;
+    }
     if (vm.count("output")) {
         string filename = vm["output"].as<string>();
         ofstream os{filename, ios::binary};
@@ -256,13 +543,13 @@ int main(int ac, char* av[]) {
             error("error while opening file " + filename);
             return EXIT_FAILURE;
         }
-        res.save(os);
+        res.save(os, vm.count("save-output-layer"));
         if (os.bad()) {
             error("error while saving the model in " + filename);
             return EXIT_FAILURE;
         }
     } else {
-        res.save(cout);
+        res.save(cout, vm.count("save-output-layer"));
     }
     return EXIT_SUCCESS;
 }
\ No newline at end of file